@@ -13,6 +13,7 @@ mocha-ipc_files := \
 	mocha-ipc/ipc_dispatch.c \
 	mocha-ipc/misc.c \
 	mocha-ipc/util.c \
+	mocha-ipc/slab.c \
 	mocha-ipc/fm.c \
 	mocha-ipc/lbs.c \
 	mocha-ipc/proto.c \
@@ -125,6 +126,7 @@ mocha-ril_files := \
 	mocha-ril/snd.c \
 	mocha-ril/gprs.c \
 	mocha-ril/gps.c \
+	mocha-ril/netlink.c \
 	mocha-ril/util.c
 
 LOCAL_SHARED_LIBRARIES := \
@@ -52,6 +52,8 @@ struct fmPacketHeader {
 struct fmRequest {
 	struct fmPacketHeader header; 	// has to be the same in responsepacket, probably fm request counter
 	uint8_t *reqBuf; 		//usually first comes unsigned int params, and then string containing name
+	uint32_t magic;			//of the frame it came in, for responses sent later
+	uint32_t cmd;
 };
 
 struct fmResponse {
@@ -59,8 +61,16 @@ struct fmResponse {
 	int32_t funcRet; 		//called function return value
 	int32_t errorVal; 		//0 if func_ret == 0, otherwise retvalue of platform LastError()
 	uint8_t *respBuf;
+	uint8_t *frame;			//if set, respBuf lives in it behind FM_RESPONSE_HEADROOM free bytes
+	ipc_stream_fill_cb respFill;	//if set, respBuf is produced piece by piece while the frame is sent
+	void *respFillData;
+	void (*respFillEnd)(void *data);	//releases respFillData once the frame was sent
+	uint8_t deferred;		//if set, the response is sent later by the FM committer
 };
 
+/* Header, funcRet and errorVal, written in front of respBuf when sending */
+#define FM_RESPONSE_HEADROOM	(sizeof(struct fmPacketHeader) + 2 * sizeof(int32_t))
+
 /*
  * Access Modes
  */
@@ -235,6 +245,17 @@ int32_t FmRemoveDir(struct fmRequest *, struct fmResponse *);
 int32_t FmGetQuotaSpace(struct fmRequest *, struct fmResponse *);
 //int32_t FmInvalidFile(unsigned int mode, const char *fileName);
 
+/*
+ * When the CP gets the answer to a flush request
+ */
+enum fm_durability {
+	FM_DURABILITY_IMMEDIATE = 0,	/* right away, the data is synced in the background */
+	FM_DURABILITY_COMMIT = 1,	/* once the sync pass covering it is done */
+	FM_DURABILITY_DEADLINE = 2,	/* as COMMIT, but no later than the deadline */
+};
+
 int32_t ipc_parse_fm(struct ipc_client* client, struct modem_io *ipc_frame);
+void fm_set_durability(int policy, uint32_t deadline_ms);
+void fm_dump_open_files(void);
 
 #endif
@@ -161,13 +161,25 @@ typedef struct {
 	uint8_t netBuf[0];
 } __attribute__((__packed__)) protoTransferDataBuf;
 
+typedef struct {
+	uint16_t opMode;
+	uint16_t protoType;
+	uint32_t contextId;
+} __attribute__((__packed__)) protoRrcConnection;
+
+/* Room to keep free in front of an uplink packet for proto_send_data_inplace */
+#define PROTO_DATA_HEADROOM	(sizeof(struct protoPacketHeader) + sizeof(protoTransferDataBuf))
+
 void ipc_parse_proto(struct ipc_client* client, struct modem_io *ipc_frame);
 void proto_send_packet(struct protoPacket* protoReq);
 void proto_startup(void);
 void proto_start_network(protoStartNetwork* startNetwork);
 void proto_stop_network(protoStopNetwork* stopNetwork);
+void proto_stop_rrc_connection(protoRrcConnection* rrcConnection);
 void proto_ds_network_resp(uint8_t* buf);
 void proto_some_unload_function(uint32_t buf);
 void proto_send_data(uint16_t opMode, uint16_t protoType, uint32_t contextId, uint32_t netBufLen, uint8_t *netBuf);
+void proto_send_data_inplace(uint16_t opMode, uint16_t protoType, uint32_t contextId, uint32_t netBufLen, uint8_t *frame);
+void proto_prepare_data(uint16_t opMode, uint16_t protoType, uint32_t contextId, uint32_t netBufLen, uint8_t *frame, struct modem_io *request);
 
 #endif
@@ -89,6 +89,7 @@ enum ipc_ril_cb_type {
     PROTO_RECEIVE_DATA_IND,
     PROTO_SUSPEND_NETWORK_IND,
     PROTO_RESUME_NETWORK_IND,
+    PROTO_RRC_CONNECTION_IND,
 	IPC_RIL_CB_LAST
 };
 
@@ -116,6 +117,8 @@ typedef void (*ipc_client_log_handler_cb)(const char *message, void *user_data);
 
 typedef int (*ipc_io_handler_cb)(void *data, unsigned int size, void *io_data);
 typedef int (*ipc_handler_cb)(void *data);
+/* Fills length bytes of a streamed frame, starting at offset in its data */
+typedef int (*ipc_stream_fill_cb)(void *data, uint8_t *buffer, uint32_t offset, uint32_t length);
 
 struct ipc_client;
 struct ipc_handlers;
@@ -156,6 +159,7 @@ int ipc_client_recv(struct ipc_client *client, struct modem_io *ipc_frame);
 
 /* Convenience functions for ipc_send */
 int ipc_client_send(struct ipc_client *client, struct modem_io *ipc_frame);
+int ipc_client_send_stream(struct ipc_client *client, struct modem_io *ipc_frame, ipc_stream_fill_cb fill, void *fill_data);
 void ipc_client_send_get(struct ipc_client *client, const unsigned short command, unsigned char mseq);
 void ipc_client_send_exec(struct ipc_client *client, const unsigned short command, unsigned char mseq);
 
@@ -186,6 +190,11 @@ static inline void ipc_send(struct modem_io *ipc_frame)
 	ipc_client_send(client, ipc_frame);
 }
 
+static inline int ipc_send_stream(struct modem_io *ipc_frame, ipc_stream_fill_cb fill, void *fill_data)
+{
+	return ipc_client_send_stream(client, ipc_frame, fill, fill_data);
+}
+
 static inline int ipc_modem_io(void *data, uint32_t cmd)
 {
 	return ipc_client_modem_operations(client, data, cmd);
@@ -194,6 +203,7 @@ static inline int ipc_modem_io(void *data, uint32_t cmd)
 #else
 	extern void hex_dump(void *data, int size);
 	extern void ipc_send(struct modem_io *ipc_frame);
+	extern int ipc_send_stream(struct modem_io *ipc_frame, ipc_stream_fill_cb fill, void *fill_data);
 	extern int ipc_modem_io(void *data, uint32_t cmd);
 
 #endif //RIL_SHLIB
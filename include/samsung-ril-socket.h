@@ -51,10 +51,15 @@
 #define SRS_GPS_DELETE_DATA		0x0307
 #define SRS_GPS_HELLO			0x03FF
 
+#define SRS_GPRS			0x04
+#define SRS_GPRS_STATS			0x0401
+
 #define SRS_CONTROL_CAFFE		0xCAFFE
 
 #define NMEA_SENTENCE_MAX_LENGTH 200
 
+#define SRS_GPRS_LATENCY_BUCKETS	12
+
 struct srs_header {
 	unsigned int length;
 	unsigned char group;
@@ -122,6 +127,26 @@ struct srs_control_ping {
 	int caffe;
 } __attribute__((__packed__));
 
+/*
+ * SRS_GPRS_STATS takes an optional int cid (0 for all connections) and is
+ * answered with one packet per matching connection
+ */
+struct srs_gprs_stats_packet {
+	int32_t cid;
+	uint32_t contextId;
+	uint32_t tx_packets;
+	uint32_t rx_packets;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint32_t tx_dropped;
+	uint32_t rx_dropped;
+	uint32_t tx_errors;
+	uint32_t rx_errors;
+	uint32_t tx_rate; /* bytes/s */
+	uint32_t rx_rate;
+	uint32_t tx_latency[SRS_GPRS_LATENCY_BUCKETS]; /* bucket n: < 128 << n us */
+} __attribute__((__packed__));
+
 typedef struct {
 	GpsUtcTime timestamp;
 	char nmea[NMEA_SENTENCE_MAX_LENGTH];
@@ -0,0 +1,59 @@
+/**
+ * This file is part of libmocha-ipc.
+ *
+ * libmocha-ipc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libmocha-ipc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libmocha-ipc.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Size classes, matched to what goes over the FIFO
+ */
+enum ipc_slab_class
+{
+	IPC_SLAB_HEADER = 0,	/* bare FIFO/TAPI/proto headers */
+	IPC_SLAB_SMALL,		/* small TAPI and proto requests */
+	IPC_SLAB_FRAME,		/* one FIFO frame, SRS message */
+	IPC_SLAB_LARGE,		/* reassembled multi-frame packets */
+	IPC_SLAB_CLASS_COUNT,
+};
+
+#define IPC_SLAB_HEADER_SIZE	0x40
+#define IPC_SLAB_SMALL_SIZE	0x200
+#define IPC_SLAB_FRAME_SIZE	0x1000
+#define IPC_SLAB_LARGE_SIZE	0x10000
+
+struct ipc_slab_stats
+{
+	uint32_t size;		/* block size of the class */
+	uint32_t in_use;	/* blocks handed out */
+	uint32_t in_use_peak;
+	uint32_t free;		/* blocks on the shared free list */
+	uint32_t created;	/* blocks taken from the heap */
+	uint32_t released;	/* blocks given back to the heap */
+	uint32_t oversized;	/* requests larger than the largest class */
+};
+
+void *ipc_slab_alloc(size_t size);
+void *ipc_slab_calloc(size_t size);
+void ipc_slab_free(void *ptr);
+int ipc_slab_get_stats(int slab_class, struct ipc_slab_stats *stats);
+void ipc_slab_dump_stats(void);
+
+#endif
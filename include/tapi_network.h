@@ -158,6 +158,7 @@ void tapi_set_offline_mode(uint8_t mode);
 void tapi_network_select(tapiNetSearchCnf* net_select);
 void tapi_network_reselect(uint8_t mode);
 void tapi_network_search(void);
+void tapi_network_search_abort(uint8_t mode);
 void tapi_set_selection_mode(uint8_t mode);
 void tapi_network_set_mode(uint32_t mode);
 void tapi_set_subscription_mode(uint8_t mode);
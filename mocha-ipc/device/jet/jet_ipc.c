@@ -28,6 +28,7 @@
 #include <fcntl.h>
 
 #include <radio.h>
+#include <slab.h>
 
 #include "ipc_private.h"
 #include "jet_ipc.h"
@@ -151,7 +152,7 @@ int32_t send_packet(struct ipc_client *client, struct modem_io *ipc_frame)
     /* Frame length: FIFO header + payload length */
     frame_length = (sizeof(*ipc) + ipc_frame->datasize);
 
-    frame = (uint8_t*)malloc(frame_length);
+    frame = (uint8_t*)ipc_slab_alloc(frame_length);
 
     /* FIFO header */
     ipc = (struct fifoPacketHeader*)(frame);
@@ -166,7 +167,7 @@ int32_t send_packet(struct ipc_client *client, struct modem_io *ipc_frame)
 
 	retval = client->handlers->write(frame, frame_length, client->handlers->write_data);
 
-    free(frame);
+    ipc_slab_free(frame);
 
     return 0;
 }
@@ -185,16 +186,15 @@ int32_t jet_ipc_send(struct ipc_client *client, struct modem_io *ipc_frame)
 		multi_packet.cmd = FIFO_PKT_FIFO_INTERNAL;
 		multi_packet.datasize = 0x0C;
 
-		multiHeader = (struct multiPacketHeader *)malloc(sizeof(struct multiPacketHeader));
+		multiHeader = (struct multiPacketHeader *)ipc_slab_alloc(sizeof(struct multiPacketHeader));
 
 		multiHeader->command = 0x02;
 		multiHeader->packtLen = ipc_frame->datasize;
 		multiHeader->packetType = ipc_frame->cmd;
 
 		multi_packet.data = (uint8_t *)multiHeader;
-		free(multiHeader);
-
 		send_packet(client, &multi_packet);
+		ipc_slab_free(multiHeader);
 
 		left_data = ipc_frame->datasize;
 
@@ -236,6 +236,8 @@ int32_t jet_ipc_recv(struct ipc_client *client, struct modem_io *ipc_frame)
     uint32_t num_read;
     uint32_t left;
 
+    ipc_frame->data = NULL;
+
     num_read = client->handlers->read((void*)buf, sizeof(buf), client->handlers->read_data);
 
     ipc = (struct fifoPacketHeader *)buf;
@@ -245,7 +247,10 @@ int32_t jet_ipc_recv(struct ipc_client *client, struct modem_io *ipc_frame)
         frame_length = ipc->datasize;
         left = frame_length;
 
-        data = (uint8_t*)malloc(left);
+        data = (uint8_t*)ipc_slab_alloc(left);
+        if(data == NULL)
+            return -1;
+
         num_read = client->handlers->read((void*)data, left, client->handlers->read_data);
 
         if(num_read == left) {
@@ -253,11 +258,13 @@ int32_t jet_ipc_recv(struct ipc_client *client, struct modem_io *ipc_frame)
             ipc_frame->cmd = ipc->cmd;
             ipc_frame->datasize = ipc->datasize;
 
-            ipc_frame->data = (uint8_t*)malloc(left);
-            memcpy(ipc_frame->data, data , ipc_frame->datasize);
+            /* The payload is handed over as is, the caller releases it */
+            ipc_frame->data = data;
 
             return 0;
         }
+
+        ipc_slab_free(data);
     }
 
     return 0;
@@ -31,6 +31,7 @@
 #include <poll.h>
 
 #include <radio.h>
+#include <slab.h>
 
 #include "ipc_private.h"
 #include "wave_ipc.h"
@@ -231,29 +232,43 @@ int32_t send_packet(struct ipc_client *client, struct modem_io *ipc_frame)
 	return client->handlers->write((void*) ipc_frame, 0, client->handlers->write_data);
 }
 
+/* Announces a frame that follows in MAX_SINGLE_FRAME_DATA sized pieces */
+static int32_t wave_ipc_send_multi_header(struct ipc_client *client, struct modem_io *ipc_frame)
+{
+	struct modem_io multi_packet;
+	struct multiPacketHeader *multiHeader;
+	int32_t rc;
+
+	DEBUG_I("packet to send is larger than 0x1000\n");
+
+	multi_packet.magic = 0xCAFECAFE;
+	multi_packet.cmd = FIFO_PKT_FIFO_INTERNAL;
+	multi_packet.datasize = 0x0C;
+
+	multiHeader = (struct multiPacketHeader *)ipc_slab_alloc(sizeof(struct multiPacketHeader));
+
+	multiHeader->command = 0x02;
+	multiHeader->packtLen = ipc_frame->datasize;
+	multiHeader->packetType = ipc_frame->cmd;
+
+	multi_packet.data = (uint8_t *)multiHeader;
+	rc = send_packet(client, &multi_packet);
+	ipc_slab_free(multiHeader);
+
+	return rc;
+}
+
 int32_t wave_ipc_send(struct ipc_client *client, struct modem_io *ipc_frame)
 {
 	int32_t left_data;
 	struct modem_io multi_packet;
-	struct multiPacketHeader *multiHeader;
 
 	if (ipc_frame->datasize > MAX_SINGLE_FRAME_DATA)
 	{
-		DEBUG_I("packet to send is larger than 0x1000\n");
+		wave_ipc_send_multi_header(client, ipc_frame);
 
 		multi_packet.magic = 0xCAFECAFE;
 		multi_packet.cmd = FIFO_PKT_FIFO_INTERNAL;
-		multi_packet.datasize = 0x0C;
-
-		multiHeader = (struct multiPacketHeader *)malloc(sizeof(struct multiPacketHeader));
-
-		multiHeader->command = 0x02;
-		multiHeader->packtLen = ipc_frame->datasize;
-		multiHeader->packetType = ipc_frame->cmd;
-
-		multi_packet.data = (uint8_t *)multiHeader;
-		send_packet(client, &multi_packet);
-		free(multiHeader);
 
 		left_data = ipc_frame->datasize;
 
@@ -279,15 +294,66 @@ int32_t wave_ipc_send(struct ipc_client *client, struct modem_io *ipc_frame)
 	}
 	else
 	{
-		send_packet(client, ipc_frame);
+		if (send_packet(client, ipc_frame) < 0)
+			return -1;
 	}
 
 	return 0;
 }
 
+/*
+ * Same framing as wave_ipc_send, but each piece is filled right before it is
+ * written, through a single piece sized buffer
+ */
+int32_t wave_ipc_send_stream(struct ipc_client *client, struct modem_io *ipc_frame,
+	ipc_stream_fill_cb fill, void *fill_data)
+{
+	struct modem_io packet;
+	uint32_t offset;
+	uint32_t left_data;
+	int32_t rc = 0;
+
+	packet.magic = ipc_frame->magic;
+	packet.cmd = ipc_frame->cmd;
+	packet.data = (uint8_t *)ipc_slab_alloc(ipc_frame->datasize > MAX_SINGLE_FRAME_DATA ?
+		MAX_SINGLE_FRAME_DATA : ipc_frame->datasize);
+	if (packet.data == NULL)
+		return -1;
+
+	if (ipc_frame->datasize > MAX_SINGLE_FRAME_DATA)
+	{
+		if (wave_ipc_send_multi_header(client, ipc_frame) < 0)
+		{
+			ipc_slab_free(packet.data);
+			return -1;
+		}
+
+		packet.magic = 0xCAFECAFE;
+		packet.cmd = FIFO_PKT_FIFO_INTERNAL;
+	}
+
+	for (offset = 0; offset < ipc_frame->datasize; offset += packet.datasize)
+	{
+		left_data = ipc_frame->datasize - offset;
+		packet.datasize = left_data > MAX_SINGLE_FRAME_DATA ? MAX_SINGLE_FRAME_DATA : left_data;
+
+		if (fill(fill_data, packet.data, offset, packet.datasize) < 0 ||
+			send_packet(client, &packet) < 0)
+		{
+			DEBUG_E("%s: stream stopped at %u of %u bytes", __func__, offset, ipc_frame->datasize);
+			rc = -1;
+			break;
+		}
+	}
+
+	ipc_slab_free(packet.data);
+
+	return rc;
+}
+
 int32_t wave_ipc_recv(struct ipc_client *client, struct modem_io *ipc_frame)
 {
-	ipc_frame->data = (uint8_t*)malloc(SIZ_PACKET_BUFSIZE);
+	ipc_frame->data = (uint8_t*)ipc_slab_alloc(SIZ_PACKET_BUFSIZE);
     return client->handlers->read((void*)ipc_frame, 0, client->handlers->read_data);
 }
 
@@ -440,6 +506,7 @@ struct ipc_handlers wave_default_handlers = {
 struct ipc_ops wave_ops = {
     .send = wave_ipc_send,
     .recv = wave_ipc_recv,
+    .send_stream = wave_ipc_send_stream,
     .bootstrap = wave_modem_bootstrap,
     .modem_operations = wave_modem_operations,
 };
@@ -33,6 +33,7 @@
 #include <getopt.h>
 
 #include <radio.h>
+#include <slab.h>
 #include <drv.h>
 #include <errno.h>
 #include <tm.h>
@@ -107,14 +108,14 @@ void ipc_parse_drv(struct ipc_client* client, struct modem_io *ipc_frame)
 void drv_send_packet(uint8_t type, uint8_t *data, int32_t data_size)
 {
 	struct modem_io request;
-	request.data = malloc(data_size + sizeof(struct drvPacketHeader));
+	request.data = ipc_slab_alloc(data_size + sizeof(struct drvPacketHeader));
 	request.data[0] = type;
 	memcpy(request.data + 1, data, data_size);
 	request.magic = 0xCAFECAFE;
 	request.cmd = FIFO_PKT_DRV;
 	request.datasize = data_size + 1;
 	ipc_send(&request);
-	free(request.data);
+	ipc_slab_free(request.data);
 }
 
 int32_t get_nvm_data(void *data, uint32_t size)
@@ -150,7 +151,7 @@ void handleReadNvRequest(struct drvNvPacket* rxNvPacket)
 
 	DEBUG_I("size = 0x%x", rxNvPacket->size);
 
-	request.data = malloc((rxNvPacket->size) + sizeof(struct drvPacketHeader));
+	request.data = ipc_slab_alloc((rxNvPacket->size) + sizeof(struct drvPacketHeader));
 	request.data[0] = NV_BACKUP_DATA;	
 	get_nvm_data(request.data + sizeof(struct drvPacketHeader), rxNvPacket->size);
 
@@ -159,7 +160,7 @@ void handleReadNvRequest(struct drvNvPacket* rxNvPacket)
 	request.datasize = rxNvPacket->size + sizeof(struct drvPacketHeader);
 
 	ipc_send(&request);
-	free(request.data);
+	ipc_slab_free(request.data);
 }
 
 #if defined(DEVICE_JET)
@@ -27,9 +27,6 @@
  * 		 	FmFGetFileAttributes
  * 		 	FmSetFileAttributes
  * 		 	FmTruncateFile
- *			FmOpenDir
- *			FmCloseDir
- * 		 	FmReadDir
  * 		 	FmRemoveDir
  * 		 	FmGetQuotaSpaceFile
  *
@@ -46,11 +43,15 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
 #include <pthread.h>
+#include <time.h>
 #include <getopt.h>
 
 #include <fm.h>
 #include <radio.h>
+#include <slab.h>
 #include <dirent.h>
 #include <errno.h>
 
@@ -60,11 +61,255 @@
 #define MAX_OPEN_DIRS 	10
 
 #define PATH_MAX_LEN (92)
-/* Has to be used with lock held! */
+/* Only used by the path requests, which are all run by the same FM worker */
 char nameBuf[PATH_MAX_LEN];
 
-DIR* dirArray[MAX_OPEN_DIRS];
-uint32_t dirIndex = 0;
+/*
+ * Directories opened by the CP, read with getdents64 into a buffer of their
+ * own so that most ReadDir requests are answered without a system call.
+ * Handles are the slot with the generation above it, as for files.
+ */
+#define FM_DIR_BUFFER_SIZE	IPC_SLAB_LARGE_SIZE
+
+struct fm_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct fm_dir {
+	int fd;
+	uint32_t generation;
+	uint8_t *buffer;
+	int length;
+	int offset;
+	int eof;
+};
+
+/* Only used by the path requests worker */
+static struct fm_dir fm_dirs[MAX_OPEN_DIRS] = {
+	[0 ... MAX_OPEN_DIRS - 1] = { .fd = -1 },
+};
+
+/*
+ * Files opened by the CP are kept in a handle table. A handle carries the
+ * slot in its low bits, the 0x61000 tag Mocha always sets, and the generation
+ * of the slot, so that a handle the CP kept past its close is rejected instead
+ * of hitting whatever reused the slot.
+ */
+#define FM_MAX_OPEN_FILES	64
+#define FM_HANDLE_TAG		0x61000
+#define FM_HANDLE_TAG_MASK	0xFF000
+#define FM_HANDLE_SLOT_MASK	0xFFF
+#define FM_HANDLE_GEN_SHIFT	20
+#define FM_HANDLE_GEN_MASK	0x7FF
+
+struct fm_file {
+	int fd;
+	uint32_t generation;
+	int32_t mode;
+	int dirty;
+	off_t position;
+	uint32_t reads;
+	uint32_t writes;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	char path[PATH_MAX_LEN];
+
+	/* Write combining, under the commit lock */
+	uint8_t *wbuf;
+	uint32_t wbuf_len;
+	off_t wbuf_offset;
+	int64_t wbuf_since;
+	uint32_t wbuf_writes;	/* CP writes held in wbuf */
+	int32_t write_error;	/* errno of a timed write back, for the next flush or close */
+	uint32_t writes_combined;
+	uint32_t write_backs;
+};
+
+/*
+ * Small writes following each other in a file are gathered and written back
+ * in one go: when the buffer is full, on a write elsewhere in the file,
+ * before anything that looks at the file, on flush or close, and by the
+ * committer FM_WRITE_BUFFER_MS after the first of them.
+ */
+#define FM_WRITE_BUFFER_SIZE	4096
+#define FM_WRITE_COMBINE_MAX	512
+#define FM_WRITE_BUFFER_MS	50
+
+struct fm_context {
+	pthread_mutex_t mutex;
+	struct fm_file files[FM_MAX_OPEN_FILES];
+	uint16_t free_slots[FM_MAX_OPEN_FILES];
+	int free_count;
+	int initialized;
+	uint32_t stale;	/* handles rejected */
+};
+
+static struct fm_context fm_context = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Flushes are synced by a committer thread in passes, each taking all the
+ * handles dirty at that time, so that a burst of CP flushes costs one sync
+ * pass instead of one fsync each on the modem reader thread. Answers held
+ * back until their pass is done are sent by a second thread, which also
+ * answers them once their deadline passes.
+ */
+#define FM_COMMIT_MAX_ACKS	32
+/* Dirty handles on one filesystem from which one syncfs beats syncing each */
+#define FM_COMMIT_SYNCFS_MIN	4
+
+struct fm_flush_ack {
+	struct fmPacketHeader header;
+	uint32_t magic;
+	uint32_t cmd;
+	int slot;
+	uint32_t pass;		/* sync pass covering the flush */
+	int64_t deadline;	/* us, 0 if none */
+	int ready;
+	int32_t error;		/* errno of the sync, once ready */
+};
+
+struct fm_commit {
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int started;		/* -1 if the threads couldn't be started */
+	int policy;
+	uint32_t deadline_ms;
+
+	uint32_t requested;	/* last pass asked for */
+	uint32_t current;	/* pass being synced, 0 if idle */
+	uint32_t completed;
+
+	struct fm_flush_ack acks[FM_COMMIT_MAX_ACKS];
+	int ack_count;
+
+	uint32_t flushes;
+	uint32_t synced;
+	uint32_t syncfs_calls;
+	uint32_t late_acks;	/* sent on deadline */
+	uint32_t inline_syncs;	/* done on the reader thread, no room or no threads */
+
+	int buffered;		/* handles with combined writes pending */
+};
+
+static struct fm_commit fm_commit = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.policy = FM_DURABILITY_COMMIT,
+	.deadline_ms = 200,
+};
+
+/*
+ * FM requests are run by a few workers instead of the modem reader thread.
+ * Requests on a file handle always go to the worker of its slot, so they
+ * are run in the order the CP sent them; path and directory requests all go
+ * to the first worker, which is thus the only user of nameBuf and fm_dirs.
+ * While a deferred flush on a handle waits for its ack, the requests after it
+ * on that handle are held, so that their responses don't overtake the ack.
+ */
+#define FM_WORKERS	3
+
+struct fm_work {
+	struct fm_work *next;
+	struct modem_io frame;	/* data right behind */
+};
+
+struct fm_worker {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+	struct fm_work *head;
+	struct fm_work *tail;
+	int holds[FM_MAX_OPEN_FILES];	/* flush acks still to be sent, per slot */
+	struct fm_work *held_head[FM_MAX_OPEN_FILES];
+	struct fm_work *held_tail[FM_MAX_OPEN_FILES];
+	uint32_t queued;
+	uint32_t queued_peak;
+	uint32_t done;
+};
+
+static struct fm_worker fm_workers[FM_WORKERS];
+static pthread_once_t fm_workers_once = PTHREAD_ONCE_INIT;
+
+static struct fm_worker *fm_worker_slot(int slot)
+{
+	return &fm_workers[1 + slot % (FM_WORKERS - 1)];
+}
+
+/* Returns the slot of the handle a request is about, -1 for other requests */
+static int fm_request_slot(struct modem_io *ipc_frame)
+{
+	struct fmPacketHeader *header;
+	int32_t handle;
+
+	header = (struct fmPacketHeader *) ipc_frame->data;
+	if(ipc_frame->datasize < sizeof(struct fmPacketHeader) + sizeof(handle))
+		return -1;
+
+	switch(header->fmPacketType + 0xEFFFFFFF) {
+		case FM_CLOSEFILE:
+		case FM_READFILE:
+		case FM_WRITEFILE:
+		case FM_FLUSHFILE:
+		case FM_SEEKFILE:
+		case FM_TELLFILE:
+		case FM_FGETFILEATTR:
+		case FM_TRUNCATEFILE:
+			handle = *(int32_t *)(ipc_frame->data + sizeof(struct fmPacketHeader));
+			return (handle & FM_HANDLE_SLOT_MASK) < FM_MAX_OPEN_FILES ? (int) (handle & FM_HANDLE_SLOT_MASK) : -1;
+		default:
+			return -1;
+	}
+}
+
+/*
+ * Attributes of the paths the CP asks about are kept, errors included, and
+ * dropped on our own changes to them or on an inotify event in their
+ * directory. A path whose directory can't be watched isn't kept.
+ */
+#define FM_STAT_CACHE_SIZE	32
+#define FM_STAT_WATCHES_MAX	16
+
+struct fm_stat_entry {
+	char path[PATH_MAX_LEN];
+	uint32_t hash;
+	int name;		/* offset of the file name in path */
+	int watch;		/* of its directory, -1 if the entry is unused */
+	int32_t error;
+	struct stat st;
+	uint32_t used;
+};
+
+struct fm_stat_watch {
+	int wd;			/* -1 once the kernel dropped it */
+	char dir[PATH_MAX_LEN];
+};
+
+struct fm_stat_cache {
+	pthread_mutex_t mutex;
+	int fd;			/* inotify, -1 without */
+	struct fm_stat_entry entries[FM_STAT_CACHE_SIZE];
+	struct fm_stat_watch watches[FM_STAT_WATCHES_MAX];
+	int watch_count;
+	uint32_t clock;
+	uint32_t generation;	/* bumped on every invalidation */
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t invalidations;
+};
+
+static struct fm_stat_cache fm_stat_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+static pthread_once_t fm_stat_cache_once = PTHREAD_ONCE_INIT;
 
 #if defined(DEVICE_JET)
 char *mochaRoot = "/KFAT0";
@@ -96,6 +341,159 @@ int32_t (*fileOps[MAX_FILE_OPS])(struct fmRequest *, struct fmResponse *) =
 	&FmGetQuotaSpace
 };
 
+static void fm_context_init(struct fm_context *context)
+{
+	int i;
+
+	for(i = 0; i < FM_MAX_OPEN_FILES; i++) {
+		context->files[i].fd = -1;
+		context->free_slots[i] = FM_MAX_OPEN_FILES - 1 - i;
+	}
+	context->free_count = FM_MAX_OPEN_FILES;
+	context->initialized = 1;
+}
+
+/* Returns the CP handle for fd, -1 with errno set when the table is full */
+static int32_t fm_file_register(int fd, const char *path, int32_t mode)
+{
+	struct fm_context *context = &fm_context;
+	struct fm_file *file;
+	int32_t handle;
+	int slot;
+
+	pthread_mutex_lock(&context->mutex);
+
+	if(!context->initialized)
+		fm_context_init(context);
+
+	if(context->free_count == 0) {
+		pthread_mutex_unlock(&context->mutex);
+		DEBUG_E("%s: no free handle for %s", __func__, path);
+		fm_dump_open_files();
+		errno = EMFILE;
+		return -1;
+	}
+
+	slot = context->free_slots[--context->free_count];
+	file = &context->files[slot];
+
+	file->generation = (file->generation + 1) & FM_HANDLE_GEN_MASK;
+	if(file->generation == 0)
+		file->generation = 1;
+
+	file->fd = fd;
+	file->mode = mode;
+	file->dirty = 0;
+	file->position = (mode & FM_APPEND) ? lseek(fd, 0, SEEK_END) : 0;
+	file->reads = file->writes = 0;
+	file->bytes_read = file->bytes_written = 0;
+	file->wbuf = NULL;
+	file->wbuf_len = 0;
+	file->wbuf_writes = 0;
+	file->write_error = 0;
+	file->writes_combined = file->write_backs = 0;
+	strncpy(file->path, path, sizeof(file->path) - 1);
+	file->path[sizeof(file->path) - 1] = '\0';
+
+	handle = (file->generation << FM_HANDLE_GEN_SHIFT) | FM_HANDLE_TAG | slot;
+
+	pthread_mutex_unlock(&context->mutex);
+
+	return handle;
+}
+
+/*
+ * Returns NULL with errno set to EBADF for unknown and stale handles.
+ * The record may only be used by the worker running the requests on that
+ * handle, and only for the request at hand: that worker is the one closing
+ * it. Other threads only look at records under the commit lock, and skip
+ * the ones with no fd.
+ */
+static struct fm_file *fm_file_get(int32_t handle)
+{
+	struct fm_context *context = &fm_context;
+	struct fm_file *file;
+	uint32_t slot;
+
+	pthread_mutex_lock(&context->mutex);
+
+	if(!context->initialized)
+		fm_context_init(context);
+
+	slot = handle & FM_HANDLE_SLOT_MASK;
+	if((handle & FM_HANDLE_TAG_MASK) != FM_HANDLE_TAG || slot >= FM_MAX_OPEN_FILES)
+		goto stale;
+
+	file = &context->files[slot];
+	if(file->fd < 0 || file->generation != ((handle >> FM_HANDLE_GEN_SHIFT) & FM_HANDLE_GEN_MASK))
+		goto stale;
+
+	pthread_mutex_unlock(&context->mutex);
+
+	return file;
+
+stale:
+	context->stale++;
+	pthread_mutex_unlock(&context->mutex);
+	DEBUG_E("%s: rejecting stale handle 0x%x", __func__, handle);
+	errno = EBADF;
+	return NULL;
+}
+
+/*
+ * Has to be called with the commit lock held: the committer and the write
+ * buffer code must not find the previous file's state once the slot is reused
+ */
+static void fm_file_release(struct fm_file *file)
+{
+	struct fm_context *context = &fm_context;
+
+	if(file->wbuf_len > 0)
+		fm_commit.buffered--;
+	file->dirty = 0;
+	ipc_slab_free(file->wbuf);
+	file->wbuf = NULL;
+	file->wbuf_len = 0;
+	file->wbuf_writes = 0;
+	file->write_error = 0;
+
+	pthread_mutex_lock(&context->mutex);
+	file->fd = -1;
+	context->free_slots[context->free_count++] = file - context->files;
+	pthread_mutex_unlock(&context->mutex);
+}
+
+void fm_dump_open_files(void)
+{
+	struct fm_context *context = &fm_context;
+	struct fm_file *file;
+	int i;
+
+	if(!context->initialized)
+		return;
+
+	DEBUG_I("%d files open, %u stale handles rejected", FM_MAX_OPEN_FILES - context->free_count, context->stale);
+	DEBUG_I("%u flushes in %u sync passes, %u handles synced, %u syncfs, %u acked on deadline, %u synced inline",
+		fm_commit.flushes, fm_commit.completed, fm_commit.synced, fm_commit.syncfs_calls,
+		fm_commit.late_acks, fm_commit.inline_syncs);
+	DEBUG_I("attributes cache: %u hits, %u misses, %u invalidations, %d directories watched",
+		fm_stat_cache.hits, fm_stat_cache.misses, fm_stat_cache.invalidations, fm_stat_cache.watch_count);
+	for(i = 0; i < FM_WORKERS; i++)
+		DEBUG_I("worker %d%s: %u requests done, %u queued (peak %u)", i, fm_workers[i].running ? "" : " (inline)",
+			fm_workers[i].done, fm_workers[i].queued, fm_workers[i].queued_peak);
+
+	for(i = 0; i < FM_MAX_OPEN_FILES; i++) {
+		file = &context->files[i];
+		if(file->fd < 0)
+			continue;
+
+		DEBUG_I("0x%x: %s, mode 0x%x, position %ld%s, %u reads (%llu bytes), %u writes (%llu bytes), %u write syscalls saved",
+			(file->generation << FM_HANDLE_GEN_SHIFT) | FM_HANDLE_TAG | i, file->path, file->mode,
+			(long) file->position, file->dirty ? ", dirty" : "", file->reads, (unsigned long long) file->bytes_read,
+			file->writes, (unsigned long long) file->bytes_written, file->writes_combined - file->write_backs);
+	}
+}
+
 int32_t FmGetLastError()
 {
 	int32_t ret;
@@ -110,6 +508,9 @@ int32_t FmGetLastError()
 		case EBADF:
 			ret = FM_INVALID_FILE_HANDLE;
 		break;
+		case EMFILE:
+			ret = FM_FILE_MAX_OPEN_ERROR;
+		break;
 		case EEXIST:
 		case ENOTDIR:
 			ret = FM_INVALID_PATH_ERROR; /* FM_ENTRY_EXIST_ERROR might be more appropiate here, though Mocha appears to use INVALID_PATH */
@@ -122,10 +523,796 @@ int32_t FmGetLastError()
 	return ret;
 }
 
+static int64_t fm_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Condition timeouts are on the realtime clock, deadlines on the monotonic one */
+static void fm_timespec_at(struct timespec *ts, int64_t at)
+{
+	int64_t delay;
+
+	delay = at - fm_time_us();
+	if(delay < 0)
+		delay = 0;
+
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += delay / 1000000;
+	ts->tv_nsec += (delay % 1000000) * 1000;
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Writes back the combined writes of file. Has to be called with the commit lock held */
+static int fm_write_buffer_flush(struct fm_file *file)
+{
+	uint32_t done = 0;
+	int32_t error = 0;
+	ssize_t rc;
+
+	if(file->wbuf_len == 0)
+		return 0;
+
+	while(done < file->wbuf_len) {
+		rc = pwrite(file->fd, file->wbuf + done, file->wbuf_len - done, file->wbuf_offset + done);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc <= 0) {
+			error = (rc == 0 ? EIO : errno);
+			DEBUG_E("%s: lost %u bytes of %s: %s", __func__, file->wbuf_len - done, file->path, strerror(error));
+			break;
+		}
+		done += rc;
+	}
+
+	file->wbuf_len = 0;
+	file->wbuf_writes = 0;
+	file->write_backs++;
+	file->dirty = 1;
+	fm_commit.buffered--;
+
+	if(error != 0) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes back the combined writes before file is looked at, a failure is
+ * left for the next flush or close to report
+ */
+static void fm_write_buffer_drain(struct fm_file *file)
+{
+	if(file == NULL)
+		return;
+
+	pthread_mutex_lock(&fm_commit.mutex);
+	if(fm_write_buffer_flush(file) < 0)
+		file->write_error = errno;
+	pthread_mutex_unlock(&fm_commit.mutex);
+}
+
+/*
+ * Writes back the buffers older than FM_WRITE_BUFFER_MS. Returns when the
+ * next one is due, 0 if none is left. Has to be called with the commit lock
+ * held
+ */
+static int64_t fm_write_buffer_expire(int64_t now)
+{
+	struct fm_file *file;
+	int64_t due;
+	int64_t next = 0;
+	int i;
+
+	for(i = 0; i < FM_MAX_OPEN_FILES; i++) {
+		file = &fm_context.files[i];
+		if(file->fd < 0 || file->wbuf_len == 0)
+			continue;
+
+		due = file->wbuf_since + FM_WRITE_BUFFER_MS * 1000;
+		if(due <= now) {
+			if(fm_write_buffer_flush(file) < 0)
+				file->write_error = errno;
+		} else if(next == 0 || due < next) {
+			next = due;
+		}
+	}
+
+	return next;
+}
+
+void fm_set_durability(int policy, uint32_t deadline_ms)
+{
+	if(policy < FM_DURABILITY_IMMEDIATE || policy > FM_DURABILITY_DEADLINE) {
+		DEBUG_E("%s: unknown policy %d, keeping %d", __func__, policy, fm_commit.policy);
+		return;
+	}
+
+	pthread_mutex_lock(&fm_commit.mutex);
+	fm_commit.policy = policy;
+	fm_commit.deadline_ms = deadline_ms;
+	pthread_mutex_unlock(&fm_commit.mutex);
+
+	DEBUG_I("%s: policy %d, deadline %ums", __func__, policy, deadline_ms);
+}
+
+static int fm_syncfs(int fd)
+{
+#ifdef __NR_syncfs
+	return syscall(__NR_syncfs, fd);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+struct fm_commit_entry {
+	int slot;
+	int fd;		/* dup of the handle, so a close meanwhile doesn't matter */
+	dev_t dev;
+	int32_t error;
+};
+
+/*
+ * Syncs the collected handles: one syncfs for each filesystem holding
+ * enough of them, fdatasync for the rest
+ */
+static void fm_commit_sync(struct fm_commit_entry *entries, int count)
+{
+	struct stat st;
+	int syncfs_done;
+	int same_dev;
+	int32_t error;
+	int i, j;
+
+	for(i = 0; i < count; i++) {
+		if(entries[i].error < 0)
+			entries[i].dev = fstat(entries[i].fd, &st) == 0 ? st.st_dev : 0;
+	}
+
+	for(i = 0; i < count; i++) {
+		if(entries[i].error >= 0)
+			continue;
+
+		same_dev = 0;
+		for(j = i; j < count; j++) {
+			if(entries[j].error < 0 && entries[j].dev == entries[i].dev)
+				same_dev++;
+		}
+
+		syncfs_done = 0;
+		if(same_dev >= FM_COMMIT_SYNCFS_MIN && entries[i].dev != 0) {
+			error = fm_syncfs(entries[i].fd) < 0 ? errno : 0;
+			if(error != ENOSYS) {
+				fm_commit.syncfs_calls++;
+				for(j = i; j < count; j++) {
+					if(entries[j].error < 0 && entries[j].dev == entries[i].dev)
+						entries[j].error = error;
+				}
+				syncfs_done = 1;
+			}
+		}
+
+		if(!syncfs_done)
+			entries[i].error = fdatasync(entries[i].fd) < 0 ? errno : 0;
+	}
+}
+
+static void *fm_commit_thread(void *data)
+{
+	struct fm_commit_entry entries[FM_MAX_OPEN_FILES];
+	struct fm_file *file;
+	struct timespec ts;
+	int64_t wakeup;
+	int64_t start;
+	int count;
+	int i, j;
+
+	pthread_mutex_lock(&fm_commit.mutex);
+
+	while(1) {
+		while(fm_commit.requested == fm_commit.completed) {
+			wakeup = fm_commit.buffered > 0 ? fm_write_buffer_expire(fm_time_us()) : 0;
+			if(wakeup == 0) {
+				pthread_cond_wait(&fm_commit.work, &fm_commit.mutex);
+			} else {
+				fm_timespec_at(&ts, wakeup);
+				pthread_cond_timedwait(&fm_commit.work, &fm_commit.mutex, &ts);
+			}
+		}
+
+		fm_commit.current = fm_commit.completed + 1;
+
+		count = 0;
+		for(i = 0; i < FM_MAX_OPEN_FILES; i++) {
+			file = &fm_context.files[i];
+			if(file->fd < 0 || !file->dirty)
+				continue;
+
+			entries[count].slot = i;
+			entries[count].error = -1;
+			entries[count].fd = dup(file->fd);
+			if(entries[count].fd < 0) {
+				/* Closes wait for the mutex, so the handle itself can be synced here */
+				DEBUG_E("%s: couldn't dup %s: %s", __func__, file->path, strerror(errno));
+				entries[count].error = fdatasync(file->fd) < 0 ? errno : 0;
+			}
+			file->dirty = 0;
+			count++;
+		}
+
+		pthread_mutex_unlock(&fm_commit.mutex);
+
+		start = fm_time_us();
+		fm_commit_sync(entries, count);
+		for(i = 0; i < count; i++) {
+			if(entries[i].fd >= 0)
+				close(entries[i].fd);
+		}
+
+		if(count > 0)
+			DEBUG_I("%s: pass %u synced %d handles in %lldus", __func__, fm_commit.current,
+				count, (long long) (fm_time_us() - start));
+
+		pthread_mutex_lock(&fm_commit.mutex);
+
+		fm_commit.synced += count;
+		fm_commit.completed = fm_commit.current;
+		fm_commit.current = 0;
+
+		for(i = 0; i < fm_commit.ack_count; i++) {
+			if(fm_commit.acks[i].ready || fm_commit.acks[i].pass > fm_commit.completed)
+				continue;
+
+			fm_commit.acks[i].ready = 1;
+			fm_commit.acks[i].error = 0;
+			for(j = 0; j < count; j++) {
+				if(entries[j].slot == fm_commit.acks[i].slot)
+					fm_commit.acks[i].error = entries[j].error;
+			}
+		}
+
+		pthread_cond_signal(&fm_commit.done);
+	}
+
+	return NULL;
+}
+
+static void fm_worker_hold(int slot)
+{
+	struct fm_worker *worker = fm_worker_slot(slot);
+
+	pthread_mutex_lock(&worker->mutex);
+	worker->holds[slot]++;
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+/* Puts the requests held on slot back in front of the queue, in order */
+static void fm_worker_release(int slot)
+{
+	struct fm_worker *worker = fm_worker_slot(slot);
+
+	pthread_mutex_lock(&worker->mutex);
+	if(--worker->holds[slot] == 0 && worker->held_head[slot] != NULL) {
+		worker->held_tail[slot]->next = worker->head;
+		if(worker->head == NULL)
+			worker->tail = worker->held_tail[slot];
+		worker->head = worker->held_head[slot];
+		worker->held_head[slot] = NULL;
+		worker->held_tail[slot] = NULL;
+		pthread_cond_signal(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+/* Sends a response made of funcRet and errorVal only */
+static void fm_status_send(uint32_t magic, uint32_t cmd, struct fmPacketHeader *header, int32_t error)
+{
+	struct fmResponse tx_packet;
+	struct modem_io request;
+	uint8_t frame[FM_RESPONSE_HEADROOM];
+
+	errno = error;
+	tx_packet.header = *header;
+	tx_packet.errorVal = (error != 0 ? FmGetLastError() : 0);
+	tx_packet.funcRet = (error != 0 ? 0 : 1); /* false/true */
+	tx_packet.header.packetLen = sizeof(tx_packet.errorVal) + sizeof(tx_packet.funcRet);
+
+	*(struct fmPacketHeader *)(frame) = tx_packet.header;
+	*(uint32_t *)(frame + sizeof(struct fmPacketHeader)) = tx_packet.funcRet;
+	*(uint32_t *)(frame + sizeof(struct fmPacketHeader) + sizeof(tx_packet.funcRet)) = tx_packet.errorVal;
+
+	request.magic = magic;
+	request.cmd = cmd;
+	request.datasize = sizeof(frame);
+	request.data = frame;
+
+	ipc_send(&request);
+}
+
+static void fm_flush_ack_send(struct fm_flush_ack *ack, int32_t error)
+{
+	fm_status_send(ack->magic, ack->cmd, &ack->header, error);
+}
+
+static void *fm_ack_thread(void *data)
+{
+	struct fm_flush_ack acks[FM_COMMIT_MAX_ACKS];
+	struct timespec ts;
+	int64_t now;
+	int64_t wakeup;
+	int count;
+	int late;
+	int i;
+
+	pthread_mutex_lock(&fm_commit.mutex);
+
+	while(1) {
+		now = fm_time_us();
+		wakeup = 0;
+		count = 0;
+
+		for(i = 0; i < fm_commit.ack_count; ) {
+			late = !fm_commit.acks[i].ready && fm_commit.acks[i].deadline != 0 &&
+				fm_commit.acks[i].deadline <= now;
+
+			if(fm_commit.acks[i].ready || late) {
+				acks[count] = fm_commit.acks[i];
+				if(late) {
+					/* The pass still syncs it, the CP just doesn't wait for it */
+					acks[count].error = 0;
+					fm_commit.late_acks++;
+				}
+				count++;
+				fm_commit.acks[i] = fm_commit.acks[--fm_commit.ack_count];
+				continue;
+			}
+
+			if(fm_commit.acks[i].deadline != 0 && (wakeup == 0 || fm_commit.acks[i].deadline < wakeup))
+				wakeup = fm_commit.acks[i].deadline;
+			i++;
+		}
+
+		if(count > 0) {
+			pthread_mutex_unlock(&fm_commit.mutex);
+			for(i = 0; i < count; i++) {
+				fm_flush_ack_send(&acks[i], acks[i].error);
+				fm_worker_release(acks[i].slot);
+			}
+			pthread_mutex_lock(&fm_commit.mutex);
+			continue;
+		}
+
+		if(wakeup == 0) {
+			pthread_cond_wait(&fm_commit.done, &fm_commit.mutex);
+		} else {
+			fm_timespec_at(&ts, wakeup);
+			pthread_cond_timedwait(&fm_commit.done, &fm_commit.mutex, &ts);
+		}
+	}
+
+	return NULL;
+}
+
+/* Has to be called with the commit lock held */
+static int fm_commit_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if(fm_commit.started != 0)
+		return fm_commit.started;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if(pthread_create(&thread, &attr, fm_commit_thread, NULL) != 0 ||
+		pthread_create(&thread, &attr, fm_ack_thread, NULL) != 0) {
+		DEBUG_E("%s: FM commit threads initialization failed", __func__);
+		fm_commit.started = -1;
+	} else {
+		fm_commit.started = 1;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return fm_commit.started;
+}
+
+/*
+ * Takes a small write into the buffer of file when it follows the writes
+ * already there. Returns 1 if it did, 0 if the write has to be done as
+ * usual, -1 if writing back the buffer failed.
+ */
+static int fm_write_buffer_add(struct fm_file *file, uint8_t *data, uint32_t size)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&fm_commit.mutex);
+
+	if(file->wbuf_len > 0 && (file->position != file->wbuf_offset + file->wbuf_len ||
+		file->wbuf_len + size > FM_WRITE_BUFFER_SIZE || size > FM_WRITE_COMBINE_MAX)) {
+		if(fm_write_buffer_flush(file) < 0) {
+			rc = -1;
+			goto done;
+		}
+	}
+
+	/* Appends land wherever the end is, and the committer does the timing */
+	if(size > FM_WRITE_COMBINE_MAX || (file->mode & FM_APPEND) || fm_commit_start() < 0)
+		goto done;
+
+	if(file->wbuf == NULL) {
+		file->wbuf = (uint8_t *) ipc_slab_alloc(FM_WRITE_BUFFER_SIZE);
+		if(file->wbuf == NULL)
+			goto done;
+	}
+
+	if(file->wbuf_len == 0) {
+		file->wbuf_offset = file->position;
+		file->wbuf_since = fm_time_us();
+		if(fm_commit.buffered++ == 0)
+			pthread_cond_signal(&fm_commit.work);
+	}
+
+	memcpy(file->wbuf + file->wbuf_len, data, size);
+	file->wbuf_len += size;
+	file->wbuf_writes++;
+	file->writes_combined++;
+	rc = 1;
+
+	if(file->wbuf_len == FM_WRITE_BUFFER_SIZE && fm_write_buffer_flush(file) < 0)
+		rc = -1;
+
+done:
+	pthread_mutex_unlock(&fm_commit.mutex);
+
+	return rc;
+}
+
+/*
+ * Hands a flush over to the committer. Returns 1 if the response is left to
+ * the committer, 0 if it can be sent now and -1 if the caller has to sync
+ * by itself.
+ */
+static int fm_commit_flush(struct fmRequest *rx_packet, struct fm_file *file)
+{
+	struct fm_flush_ack *ack;
+	uint32_t pass;
+	int rc = 0;
+
+	pthread_mutex_lock(&fm_commit.mutex);
+
+	if(fm_commit_start() < 0) {
+		rc = -1;
+		goto done;
+	}
+
+	/* A pass that already took the dirty handles doesn't cover this flush */
+	pass = (fm_commit.current != 0 ? fm_commit.current : fm_commit.completed) + 1;
+
+	if(fm_commit.policy != FM_DURABILITY_IMMEDIATE) {
+		if(fm_commit.ack_count == FM_COMMIT_MAX_ACKS) {
+			rc = -1;
+			goto done;
+		}
+
+		ack = &fm_commit.acks[fm_commit.ack_count++];
+		ack->header = rx_packet->header;
+		ack->magic = rx_packet->magic;
+		ack->cmd = rx_packet->cmd;
+		ack->slot = file - fm_context.files;
+		ack->pass = pass;
+		ack->deadline = (fm_commit.policy == FM_DURABILITY_DEADLINE) ?
+			fm_time_us() + (int64_t) fm_commit.deadline_ms * 1000 : 0;
+		ack->ready = 0;
+		rc = 1;
+
+		/* Taken before the ack thread can see the ack */
+		fm_worker_hold(ack->slot);
+	}
+
+	fm_commit.flushes++;
+	if(fm_commit.requested < pass)
+		fm_commit.requested = pass;
+	pthread_cond_signal(&fm_commit.work);
+
+done:
+	if(rc < 0)
+		fm_commit.inline_syncs++;
+	pthread_mutex_unlock(&fm_commit.mutex);
+
+	return rc;
+}
+
+static uint32_t fm_stat_hash(const char *path)
+{
+	uint32_t hash = 5381;
+
+	while(*path != '\0')
+		hash = hash * 33 + (uint8_t) *path++;
+
+	return hash;
+}
+
+/* Has to be called with the cache lock held */
+static void fm_stat_drop(struct fm_stat_entry *entry)
+{
+	entry->watch = -1;
+	fm_stat_cache.invalidations++;
+}
+
+/* Has to be called with the cache lock held */
+static void fm_stat_drop_all(void)
+{
+	int i;
+
+	for(i = 0; i < FM_STAT_CACHE_SIZE; i++) {
+		if(fm_stat_cache.entries[i].watch >= 0)
+			fm_stat_drop(&fm_stat_cache.entries[i]);
+	}
+	fm_stat_cache.generation++;
+}
+
+/* Has to be called with the cache lock held */
+static void fm_stat_event(struct inotify_event *event)
+{
+	struct fm_stat_entry *entry;
+	int watch;
+	int i;
+
+	if(event->mask & IN_Q_OVERFLOW) {
+		fm_stat_drop_all();
+		return;
+	}
+
+	for(watch = 0; watch < fm_stat_cache.watch_count; watch++) {
+		if(fm_stat_cache.watches[watch].wd == event->wd)
+			break;
+	}
+	if(watch == fm_stat_cache.watch_count)
+		return;
+
+	/* A moved directory would keep reporting under its new path */
+	if(event->mask & IN_MOVE_SELF)
+		inotify_rm_watch(fm_stat_cache.fd, event->wd);
+	if(event->mask & (IN_IGNORED | IN_MOVE_SELF))
+		fm_stat_cache.watches[watch].wd = -1;
+
+	for(i = 0; i < FM_STAT_CACHE_SIZE; i++) {
+		entry = &fm_stat_cache.entries[i];
+		if(entry->watch != watch)
+			continue;
+
+		/* Events on the directory itself concern everything in it */
+		if(event->len == 0 || strcmp(entry->path + entry->name, event->name) == 0)
+			fm_stat_drop(entry);
+	}
+	fm_stat_cache.generation++;
+}
+
+static void *fm_stat_watch_thread(void *data)
+{
+	uint32_t buffer[256];
+	struct inotify_event *event;
+	ssize_t offset;
+	ssize_t n;
+
+	while(1) {
+		n = read(fm_stat_cache.fd, buffer, sizeof(buffer));
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+
+		pthread_mutex_lock(&fm_stat_cache.mutex);
+		for(offset = 0; offset + (ssize_t) sizeof(struct inotify_event) <= n; offset += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *) ((uint8_t *) buffer + offset);
+			fm_stat_event(event);
+		}
+		pthread_mutex_unlock(&fm_stat_cache.mutex);
+	}
+
+	/* Nothing can be kept without the events */
+	DEBUG_E("%s: inotify read failed: %s", __func__, strerror(errno));
+	pthread_mutex_lock(&fm_stat_cache.mutex);
+	close(fm_stat_cache.fd);
+	fm_stat_cache.fd = -1;
+	fm_stat_drop_all();
+	pthread_mutex_unlock(&fm_stat_cache.mutex);
+
+	return NULL;
+}
+
+static void fm_stat_cache_init(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	for(i = 0; i < FM_STAT_CACHE_SIZE; i++)
+		fm_stat_cache.entries[i].watch = -1;
+
+	fm_stat_cache.fd = inotify_init();
+	if(fm_stat_cache.fd < 0) {
+		DEBUG_E("%s: no inotify, attributes won't be cached: %s", __func__, strerror(errno));
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, fm_stat_watch_thread, NULL) != 0) {
+		DEBUG_E("%s: FM watch thread initialization failed", __func__);
+		close(fm_stat_cache.fd);
+		fm_stat_cache.fd = -1;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* Returns the watch on the directory of path, -1 if it can't be watched. Has to be called with the cache lock held */
+static int fm_stat_watch_get(const char *path, int name)
+{
+	struct fm_stat_watch *watch;
+	int i;
+
+	if(name <= 1 || name > PATH_MAX_LEN)
+		return -1;
+
+	for(i = 0; i < fm_stat_cache.watch_count; i++) {
+		watch = &fm_stat_cache.watches[i];
+		if(strncmp(watch->dir, path, name - 1) == 0 && watch->dir[name - 1] == '\0')
+			break;
+	}
+
+	if(i == fm_stat_cache.watch_count) {
+		if(i == FM_STAT_WATCHES_MAX)
+			return -1;
+
+		watch = &fm_stat_cache.watches[i];
+		memcpy(watch->dir, path, name - 1);
+		watch->dir[name - 1] = '\0';
+		watch->wd = -1;
+		fm_stat_cache.watch_count++;
+	}
+
+	if(watch->wd < 0) {
+		watch->wd = inotify_add_watch(fm_stat_cache.fd, watch->dir, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+			IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+		if(watch->wd < 0)
+			return -1;
+	}
+
+	return i;
+}
+
+/* Writes back the combined writes of the handles open on path */
+static void fm_write_buffer_drain_path(const char *path)
+{
+	struct fm_file *file;
+	int i;
+
+	pthread_mutex_lock(&fm_commit.mutex);
+	for(i = 0; i < FM_MAX_OPEN_FILES; i++) {
+		file = &fm_context.files[i];
+		if(file->fd >= 0 && file->wbuf_len > 0 && strcmp(file->path, path) == 0) {
+			if(fm_write_buffer_flush(file) < 0)
+				file->write_error = errno;
+		}
+	}
+	pthread_mutex_unlock(&fm_commit.mutex);
+}
+
+/* stat(), answered from the cache when possible */
+static int fm_stat(const char *path, struct stat *st)
+{
+	struct fm_stat_entry *entry = NULL;
+	const char *slash;
+	uint32_t generation;
+	uint32_t hash;
+	int32_t error;
+	int watch = -1;
+	int name;
+	int rc;
+	int i;
+
+	pthread_once(&fm_stat_cache_once, fm_stat_cache_init);
+
+	hash = fm_stat_hash(path);
+	slash = strrchr(path, '/');
+	name = slash != NULL ? slash - path + 1 : 0;
+
+	pthread_mutex_lock(&fm_stat_cache.mutex);
+
+	for(i = 0; i < FM_STAT_CACHE_SIZE; i++) {
+		entry = &fm_stat_cache.entries[i];
+		if(entry->watch >= 0 && entry->hash == hash && strcmp(entry->path, path) == 0) {
+			entry->used = ++fm_stat_cache.clock;
+			fm_stat_cache.hits++;
+			*st = entry->st;
+			error = entry->error;
+			pthread_mutex_unlock(&fm_stat_cache.mutex);
+
+			if(error != 0) {
+				errno = error;
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	fm_stat_cache.misses++;
+	/* Watched before the stat, so that no change in between goes unnoticed */
+	if(fm_stat_cache.fd >= 0 && strlen(path) < PATH_MAX_LEN)
+		watch = fm_stat_watch_get(path, name);
+	generation = fm_stat_cache.generation;
+
+	pthread_mutex_unlock(&fm_stat_cache.mutex);
+
+	fm_write_buffer_drain_path(path);
+	rc = stat(path, st);
+	error = rc < 0 ? errno : 0;
+
+	if(watch < 0)
+		return rc;
+
+	pthread_mutex_lock(&fm_stat_cache.mutex);
+	if(fm_stat_cache.generation == generation && fm_stat_cache.watches[watch].wd >= 0) {
+		/* Least recently used entry */
+		entry = &fm_stat_cache.entries[0];
+		for(i = 1; i < FM_STAT_CACHE_SIZE && entry->watch >= 0; i++) {
+			if(fm_stat_cache.entries[i].watch < 0 || fm_stat_cache.entries[i].used < entry->used)
+				entry = &fm_stat_cache.entries[i];
+		}
+
+		strcpy(entry->path, path);
+		entry->hash = hash;
+		entry->name = name;
+		entry->watch = watch;
+		entry->error = error;
+		entry->st = *st;
+		entry->used = ++fm_stat_cache.clock;
+	}
+	pthread_mutex_unlock(&fm_stat_cache.mutex);
+
+	errno = error;
+	return rc;
+}
+
+/* Drops what is kept about path, for our own changes to it */
+static void fm_stat_invalidate(const char *path)
+{
+	struct fm_stat_entry *entry;
+	uint32_t hash;
+	int i;
+
+	pthread_once(&fm_stat_cache_once, fm_stat_cache_init);
+
+	hash = fm_stat_hash(path);
+
+	pthread_mutex_lock(&fm_stat_cache.mutex);
+	for(i = 0; i < FM_STAT_CACHE_SIZE; i++) {
+		entry = &fm_stat_cache.entries[i];
+		if(entry->watch >= 0 && entry->hash == hash && strcmp(entry->path, path) == 0)
+			fm_stat_drop(entry);
+	}
+	fm_stat_cache.generation++;
+	pthread_mutex_unlock(&fm_stat_cache.mutex);
+}
+
 int32_t FmOpenFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
 	int32_t retval = 0;
 	int32_t mode;
+	int fd;
 	uint32_t flags = O_RDONLY;
 
 	mode = *(int32_t *)(rx_packet->reqBuf);
@@ -150,13 +1337,19 @@ int32_t FmOpenFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 	else if(mode & FM_NOUPDATE_TIME)
 		flags |= O_RDWR;
 #endif
-	retval = open(nameBuf, flags, 0660);
+	if(flags & (O_CREAT | O_TRUNC))
+		fm_stat_invalidate(nameBuf);
 
-	if(retval < 0)
+	fd = open(nameBuf, flags, 0660);
+
+	if(fd < 0) {
 		DEBUG_I("%s: error! %s", __func__, strerror(errno));
-	else
-		retval |= 0x61000; /* These flags are always present in node returned by Mocha, 
-							  we'll mask them out if CP use them anyway */
+		retval = fd;
+	} else {
+		retval = fm_file_register(fd, nameBuf, mode);
+		if(retval < 0)
+			close(fd);
+	}
 	tx_packet->funcRet = retval;
 	tx_packet->errorVal = (retval < 0 ? (errno == ENOENT ? 0 : FmGetLastError()) : 0);
 	/* For some reason Mocha doesn't set error code if there's no specified file, just returns -1 */
@@ -170,18 +1363,39 @@ int32_t FmOpenFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 int32_t FmCloseFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
 	int32_t retval = 0;
-	int32_t fd;
-
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
-	
-	retval = close(fd);
+	struct fm_file *file;
+
+	file = fm_file_get(*(int32_t *)(rx_packet->reqBuf));
+	if(file != NULL) {
+		/* The committer may be picking up the fd */
+		pthread_mutex_lock(&fm_commit.mutex);
+		retval = fm_write_buffer_flush(file);
+		if(retval == 0 && file->write_error != 0) {
+			errno = file->write_error;
+			retval = -1;
+		}
+		/*
+		 * A requested pass that didn't collect the handle yet would skip it
+		 * once closed, while its flush ack may already be out: sync it here,
+		 * before that pass can complete
+		 */
+		if(file->dirty && fm_commit.requested >
+			(fm_commit.current != 0 ? fm_commit.current : fm_commit.completed)) {
+			if(fdatasync(file->fd) < 0)
+				retval = -1;
+			file->dirty = 0;
+			fm_commit.inline_syncs++;
+		}
+		if(close(file->fd) < 0)
+			retval = -1;
+		fm_file_release(file);
+		pthread_mutex_unlock(&fm_commit.mutex);
+	} else {
+		retval = -1;
+	}
 	
 	if(retval < 0)
 		DEBUG_I("%s: error! %s", __func__, strerror(errno));
-	else
-		retval |= 0x61000; /* These flags are always present in node returned by Mocha, 
-							  we'll mask them out if CP use them anyway */
 	
 	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
 	tx_packet->funcRet = (retval < 0 ? 0 : 1); /* returns true/false*/
@@ -195,18 +1409,25 @@ int32_t FmCloseFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 int32_t FmCreateFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
 	int32_t retval = 0;
-	struct stat sb;
+	int fd;
 	strcpy(nameBuf, mochaRoot);
 	strcat(nameBuf, (const char *)(rx_packet->reqBuf));
 	DEBUG_I("%s: fName %s", __func__, nameBuf);
 
-	retval = creat(nameBuf, 0777);
+	fm_stat_invalidate(nameBuf);
+	fd = creat(nameBuf, 0777);
 	
-	if(retval < 0)
+	if(fd < 0) {
 		DEBUG_I("%s: error! %s", __func__, strerror(errno));
+		retval = fd;
+	} else {
+		retval = fm_file_register(fd, nameBuf, FM_CREATE | FM_WRITE | FM_TRUNCATE);
+		if(retval < 0)
+			close(fd);
+	}
 		
 	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
-	tx_packet->funcRet = retval; /* returns fd */
+	tx_packet->funcRet = retval; /* returns the handle */
 
 	tx_packet->header.packetLen = sizeof(tx_packet->errorVal) + sizeof(tx_packet->funcRet);
 	tx_packet->respBuf = NULL;
@@ -214,30 +1435,235 @@ int32_t FmCreateFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 	return 0;
 }
 
+/*
+ * Reads bigger than FM_READ_STREAM_MIN go out in MAX_SINGLE_FRAME_DATA pieces.
+ * A reader thread fills a ring of FM_READ_STREAM_RING bytes while the frame
+ * is sent, so storage reads overlap with the link and memory stays bounded
+ * whatever the requested size. The ring is full before the client lock is
+ * taken, the sender then only copies out what was already read.
+ */
+#define FM_READ_STREAM_MIN	(MAX_SINGLE_FRAME_DATA - FM_RESPONSE_HEADROOM - sizeof(int32_t))
+#define FM_READ_STREAM_RING	(2 * MAX_SINGLE_FRAME_DATA)
+
+struct fm_read_stream {
+	int fd;
+	off_t position;
+	int32_t numRead;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint32_t produced;	/* file data bytes put in the ring */
+	uint32_t consumed;	/* file data bytes handed to the sender */
+	int stop;
+
+	uint8_t ring[FM_READ_STREAM_RING];
+};
+
+static void *fm_read_stream_thread(void *data)
+{
+	struct fm_read_stream *stream = (struct fm_read_stream *) data;
+	uint32_t produced;
+	uint32_t index;
+	uint32_t length;
+	ssize_t rc;
+
+	pthread_mutex_lock(&stream->mutex);
+
+	while(!stream->stop && stream->produced < (uint32_t) stream->numRead) {
+		if(stream->produced - stream->consumed == FM_READ_STREAM_RING) {
+			pthread_cond_wait(&stream->cond, &stream->mutex);
+			continue;
+		}
+
+		produced = stream->produced;
+		index = produced % FM_READ_STREAM_RING;
+		length = FM_READ_STREAM_RING - (produced - stream->consumed);
+		if(length > FM_READ_STREAM_RING - index)
+			length = FM_READ_STREAM_RING - index;
+		if(length > (uint32_t) stream->numRead - produced)
+			length = (uint32_t) stream->numRead - produced;
+
+		/* The sender only touches the part of the ring that was produced */
+		pthread_mutex_unlock(&stream->mutex);
+
+		rc = pread(stream->fd, stream->ring + index, length, stream->position + produced);
+		if(rc < 0 && errno == EINTR)
+			rc = 0;
+		else if(rc <= 0) {
+			/* The size is already announced, so the frame has to be completed */
+			DEBUG_E("%s: file shrank while streamed, padding %u bytes, fd: %d", __func__, length, stream->fd);
+			memset(stream->ring + index, 0, length);
+			rc = length;
+		}
+
+		pthread_mutex_lock(&stream->mutex);
+		stream->produced += rc;
+		pthread_cond_signal(&stream->cond);
+	}
+
+	pthread_mutex_unlock(&stream->mutex);
+
+	return NULL;
+}
+
+/* Produces the FmReadFile response data, numRead and then the file data */
+static int fm_read_stream_fill(void *data, uint8_t *buffer, uint32_t offset, uint32_t length)
+{
+	struct fm_read_stream *stream = (struct fm_read_stream *) data;
+	uint32_t index;
+	uint32_t count;
+
+	while(length > 0 && offset < sizeof(stream->numRead)) {
+		*buffer++ = ((uint8_t *) &stream->numRead)[offset++];
+		length--;
+	}
+
+	offset -= sizeof(stream->numRead);
+
+	pthread_mutex_lock(&stream->mutex);
+
+	/* Pieces are asked for in order, so offset is where the sender stands */
+	while(length > 0) {
+		if(stream->produced == stream->consumed) {
+			pthread_cond_wait(&stream->cond, &stream->mutex);
+			continue;
+		}
+
+		index = offset % FM_READ_STREAM_RING;
+		count = stream->produced - stream->consumed;
+		if(count > FM_READ_STREAM_RING - index)
+			count = FM_READ_STREAM_RING - index;
+		if(count > length)
+			count = length;
+
+		memcpy(buffer, stream->ring + index, count);
+		buffer += count;
+		offset += count;
+		length -= count;
+
+		stream->consumed += count;
+		pthread_cond_signal(&stream->cond);
+	}
+
+	pthread_mutex_unlock(&stream->mutex);
+
+	return 0;
+}
+
+static void fm_read_stream_end(void *data)
+{
+	struct fm_read_stream *stream = (struct fm_read_stream *) data;
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->stop = 1;
+	pthread_cond_signal(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+
+	pthread_join(stream->thread, NULL);
+
+	pthread_cond_destroy(&stream->cond);
+	pthread_mutex_destroy(&stream->mutex);
+	ipc_slab_free(stream);
+}
+
+/*
+ * Sets up a large read to be streamed: the length has to be known before the
+ * first piece goes out, so it is clamped to what the file holds. Returns once
+ * the ring is full, or holds the whole read.
+ */
+static int32_t fm_read_stream_setup(struct fm_file *file, uint32_t size, struct fmResponse *tx_packet)
+{
+	struct fm_read_stream *stream;
+	struct stat st;
+	uint32_t primed;
+	int rc;
+
+	if(fstat(file->fd, &st) < 0)
+		return -1;
+
+	stream = (struct fm_read_stream *) ipc_slab_alloc(sizeof(struct fm_read_stream));
+	if(stream == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	stream->fd = file->fd;
+	stream->position = file->position;
+	stream->numRead = (st.st_size > file->position) ? st.st_size - file->position : 0;
+	if((uint32_t) stream->numRead > size)
+		stream->numRead = size;
+	stream->produced = 0;
+	stream->consumed = 0;
+	stream->stop = 0;
+
+	pthread_mutex_init(&stream->mutex, NULL);
+	pthread_cond_init(&stream->cond, NULL);
+
+	rc = pthread_create(&stream->thread, NULL, fm_read_stream_thread, stream);
+	if(rc != 0) {
+		pthread_cond_destroy(&stream->cond);
+		pthread_mutex_destroy(&stream->mutex);
+		ipc_slab_free(stream);
+		errno = rc;
+		return -1;
+	}
+
+	primed = (uint32_t) stream->numRead < FM_READ_STREAM_RING ? (uint32_t) stream->numRead : FM_READ_STREAM_RING;
+
+	pthread_mutex_lock(&stream->mutex);
+	while(stream->produced < primed)
+		pthread_cond_wait(&stream->cond, &stream->mutex);
+	pthread_mutex_unlock(&stream->mutex);
+
+	tx_packet->respFill = fm_read_stream_fill;
+	tx_packet->respFillData = stream;
+	tx_packet->respFillEnd = fm_read_stream_end;
+
+	return stream->numRead;
+}
+
 int32_t FmReadFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
 	int32_t numRead;
 	int32_t fd;
 	uint32_t size;
-	uint8_t *responseBuf;
+	uint8_t *responseBuf = NULL;
+	struct fm_file *file;
 
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
+	file = fm_file_get(*(int32_t *)(rx_packet->reqBuf));
+	fd = file != NULL ? file->fd : -1;
 	size = *(int32_t *)((rx_packet->reqBuf) + sizeof(fd));
 
-	responseBuf = (uint8_t *)malloc(size + sizeof(numRead));
+	fm_write_buffer_drain(file);
+
+	if(file != NULL && size > FM_READ_STREAM_MIN) {
+		numRead = fm_read_stream_setup(file, size, tx_packet);
+		if(numRead >= 0)
+			DEBUG_I("%s: streaming %d bytes, fd: %d", __func__, numRead, fd);
+	} else {
+		/* The data is read right where it is sent from, behind the headers */
+		tx_packet->frame = (uint8_t *)ipc_slab_alloc(FM_RESPONSE_HEADROOM + sizeof(numRead) + size);
+		responseBuf = tx_packet->frame + FM_RESPONSE_HEADROOM;
 
-	numRead = read(fd, (responseBuf + sizeof(numRead)), size);
+		numRead = pread(fd, (responseBuf + sizeof(numRead)), size, file != NULL ? file->position : 0);
+	}
 	
-	if(numRead < 0)
+	if(numRead < 0) {
 		DEBUG_I("%s: error! %s, fd: %d", __func__, strerror(errno), fd);
+	} else {
+		file->position += numRead;
+		file->reads++;
+		file->bytes_read += numRead;
+	}
 		
-	memcpy(responseBuf, &numRead, sizeof(numRead));
+	if(responseBuf != NULL)
+		memcpy(responseBuf, &numRead, sizeof(numRead));
 
 	tx_packet->errorVal = (numRead < 0 ? FmGetLastError() : 0);
 	tx_packet->funcRet = (numRead < 0 ? 0 : 1); /* false/true */
 
-	tx_packet->header.packetLen = sizeof(tx_packet->errorVal) + sizeof(tx_packet->funcRet) + sizeof(numRead) + numRead;
+	tx_packet->header.packetLen = sizeof(tx_packet->errorVal) + sizeof(tx_packet->funcRet) + sizeof(numRead) + (numRead < 0 ? 0 : numRead);
 	tx_packet->respBuf = responseBuf;
 
 	return 0;
@@ -249,17 +1675,39 @@ int32_t FmWriteFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 	int32_t fd;
 	uint32_t size;
 	uint8_t *writeBuf;
+	struct fm_file *file;
+	int combined = 0;
 
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
+	file = fm_file_get(*(int32_t *)(rx_packet->reqBuf));
+	fd = file != NULL ? file->fd : -1;
 	size = *(int32_t *)((rx_packet->reqBuf) + sizeof(fd));
 
 	writeBuf = (uint8_t *)((rx_packet->reqBuf) + sizeof(fd) + sizeof(size));
 
-	numWrite = write(fd, writeBuf, size);
+	if(file != NULL)
+		combined = fm_write_buffer_add(file, writeBuf, size);
+
+	/* Reads go through pread at the tracked position, so writes do as well */
+	if(combined > 0)
+		numWrite = size;
+	else if(combined < 0)
+		numWrite = -1;
+	else if(file != NULL && !(file->mode & FM_APPEND))
+		numWrite = pwrite(fd, writeBuf, size, file->position);
+	else
+		numWrite = write(fd, writeBuf, size);
 	
-	if(numWrite < 0)
+	if(numWrite < 0) {
 		DEBUG_I("%s: error! %s, fd: %d", __func__, strerror(errno), fd);
+	} else {
+		/* O_APPEND moves the position to the end first */
+		file->position = (file->mode & FM_APPEND) ? lseek(fd, 0, SEEK_CUR) : file->position + numWrite;
+		if(!combined)
+			file->dirty = 1;
+		fm_stat_invalidate(file->path);
+		file->writes++;
+		file->bytes_written += numWrite;
+	}
 		
 	tx_packet->errorVal = (numWrite < 0 ? FmGetLastError() : 0);
 	tx_packet->funcRet = (numWrite < 0 ? 0 : 1); /* false/true */
@@ -273,12 +1721,36 @@ int32_t FmWriteFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 int32_t FmFlushFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
 	int32_t retval = 0;
-	int32_t fd;
+	int committed = -1;
+	struct fm_file *file;
+
+	file = fm_file_get(*(int32_t *)(rx_packet->reqBuf));
+
+	if(file != NULL) {
+		/* A timed write back that failed is reported here */
+		pthread_mutex_lock(&fm_commit.mutex);
+		retval = fm_write_buffer_flush(file);
+		if(retval == 0 && file->write_error != 0) {
+			errno = file->write_error;
+			retval = -1;
+		}
+		file->write_error = 0;
+		pthread_mutex_unlock(&fm_commit.mutex);
+	}
 
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
+	if(file != NULL && retval == 0) {
+		committed = fm_commit_flush(rx_packet, file);
+		if(committed > 0) {
+			tx_packet->deferred = 1;
+			return 0;
+		}
+	}
 
-	retval = fsync(fd);
+	if(retval == 0 && committed < 0) {
+		retval = fsync(file != NULL ? file->fd : -1);
+		if(retval == 0)
+			file->dirty = 0;
+	}
 
 	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
 	tx_packet->funcRet = (retval < 0 ? 0 : 1); /* false/true */
@@ -294,13 +1766,24 @@ int32_t FmSeekFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 	int32_t retval = 0;
 	int32_t fd;
 	uint32_t offset, origin;
+	struct fm_file *file;
 
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
+	file = fm_file_get(*(int32_t *)(rx_packet->reqBuf));
+	fd = file != NULL ? file->fd : -1;
 	origin = *(int32_t *)((rx_packet->reqBuf) + sizeof(fd));
 	offset = *(int32_t *)((rx_packet->reqBuf) + sizeof(fd) + sizeof(origin));
 
-	retval = lseek(fd, offset, origin);
+	/* The end of the file may still be in the write buffer */
+	if(origin == SEEK_END)
+		fm_write_buffer_drain(file);
+
+	/* Reads and writes don't move the kernel offset, only the tracked one */
+	if(origin == SEEK_CUR && file != NULL)
+		retval = lseek(fd, file->position + (int32_t) offset, SEEK_SET);
+	else
+		retval = lseek(fd, offset, origin);
+	if(retval >= 0)
+		file->position = retval;
 
 	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
 	tx_packet->funcRet = (retval < 0 ? 0 : 1); /* true/false */
@@ -314,12 +1797,11 @@ int32_t FmSeekFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 int32_t FmTellFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
 	int32_t retval = 0;
-	int32_t fd;
+	struct fm_file *file;
 
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
+	file = fm_file_get(*(int32_t *)(rx_packet->reqBuf));
 
-	retval = lseek(fd, 0, SEEK_CUR);
+	retval = (file != NULL ? file->position : -1);
 
 	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
 	tx_packet->funcRet = retval;
@@ -337,6 +1819,7 @@ int32_t FmRemoveFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 	strcpy(nameBuf, mochaRoot);
 	strcat(nameBuf, (const char *)(rx_packet->reqBuf));
 
+	fm_stat_invalidate(nameBuf);
 	retval = remove(nameBuf);
 
 	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
@@ -379,9 +1862,9 @@ int32_t FmGetFileAttributes(struct fmRequest *rx_packet, struct fmResponse *tx_p
 	strcat(nameBuf, (const char *)(rx_packet->reqBuf));
 	DEBUG_I("%s: fName %s", __func__, nameBuf);
 
-	retval = stat(nameBuf, &sb);
+	retval = fm_stat(nameBuf, &sb);
 
-	fAttr = (FmFileAttribute *)malloc(sizeof(FmFileAttribute));
+	fAttr = (FmFileAttribute *)ipc_slab_alloc(sizeof(FmFileAttribute));
 	memset(fAttr, 0, sizeof(FmFileAttribute));
 	
 	tx_packet->funcRet = (retval < 0 ? 0 : 1); /* returns true on success */
@@ -426,13 +1909,15 @@ int32_t FmFGetFileAttributes(struct fmRequest *rx_packet, struct fmResponse *tx_
 	struct stat sb;
 	int32_t fd;
 	FmFileAttribute *fAttr;
+	struct fm_file *file;
 
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
+	file = fm_file_get(*(int32_t *)(rx_packet->reqBuf));
+	fd = file != NULL ? file->fd : -1;
 
+	fm_write_buffer_drain(file);
 	retval = fstat(fd, &sb);
 
-	fAttr = malloc(sizeof(FmFileAttribute));
+	fAttr = ipc_slab_alloc(sizeof(FmFileAttribute));
 	memset(fAttr, 0, sizeof(FmFileAttribute));
 	
 	tx_packet->funcRet = (retval < 0 ? 0 : 1); /* returns true on success */
@@ -489,15 +1974,21 @@ int32_t FmTruncateFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet
 	int32_t retval = 0;
 	int32_t fd;
 	uint32_t length;
+	struct fm_file *file;
 
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
+	file = fm_file_get(*(int32_t *)(rx_packet->reqBuf));
+	fd = file != NULL ? file->fd : -1;
 	length = *(int32_t *)((rx_packet->reqBuf) + sizeof(fd));
 
+	fm_write_buffer_drain(file);
 	retval = ftruncate(fd, length);
+	if(file != NULL)
+		fm_stat_invalidate(file->path);
 
 	if(retval < 0)
 		DEBUG_I("%s: error! %s, fd: %d", __func__, strerror(errno), fd);
+	else
+		file->dirty = 1;
 		
 	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
 	tx_packet->funcRet = (retval < 0 ? 0 : 1); /* true/false */
@@ -508,48 +1999,148 @@ int32_t FmTruncateFile(struct fmRequest *rx_packet, struct fmResponse *tx_packet
 	return 0;
 }
 
+/* Returns NULL with errno set to EBADF for unknown and closed handles */
+static struct fm_dir *fm_dir_get(int32_t handle)
+{
+	struct fm_dir *dir;
+	uint32_t slot;
+
+	slot = handle & FM_HANDLE_SLOT_MASK;
+	if(handle < 0 || slot >= MAX_OPEN_DIRS)
+		goto stale;
+
+	dir = &fm_dirs[slot];
+	if(dir->fd < 0 || dir->generation != ((handle >> FM_HANDLE_GEN_SHIFT) & FM_HANDLE_GEN_MASK))
+		goto stale;
+
+	return dir;
+
+stale:
+	DEBUG_E("%s: rejecting directory handle 0x%x", __func__, handle);
+	errno = EBADF;
+	return NULL;
+}
+
+/* Fills entry from the next directory entry, returns 0 at the end and -1 on error */
+static int fm_dir_next(struct fm_dir *dir, FmDirEntry *entry)
+{
+	struct fm_dirent64 *dirent;
+	struct stat st;
+	int n;
+
+	while(1) {
+		if(dir->offset >= dir->length) {
+			if(dir->eof)
+				return 0;
+
+			n = syscall(__NR_getdents64, dir->fd, dir->buffer, FM_DIR_BUFFER_SIZE);
+			if(n < 0)
+				return -1;
+			if(n == 0) {
+				dir->eof = 1;
+				return 0;
+			}
+
+			dir->length = n;
+			dir->offset = 0;
+		}
+
+		dirent = (struct fm_dirent64 *) (dir->buffer + dir->offset);
+		dir->offset += dirent->d_reclen;
+
+		if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		/* Gone since it was listed */
+		if(fstatat(dir->fd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+
+		break;
+	}
+
+	memset(entry, 0, sizeof(FmDirEntry));
+	entry->type = S_ISDIR(st.st_mode) ? FM_DIR_TYPE : (S_ISREG(st.st_mode) ? FM_FILE_TYPE : FM_UNKNOWN_TYPE);
+	entry->oldFileSize = st.st_size;
+	entry->attribute = st.st_mode;
+	entry->dt = fmTime;
+	entry->oldAllocatedSize = st.st_size;
+	entry->stModifiedDataTime = fmTime;
+	entry->u64EntryUniqID = dirent->d_ino;
+	entry->fileSize = st.st_size;
+	entry->allocatedSize = st.st_size;
+	strncpy(entry->szName, dirent->d_name, sizeof(entry->szName) - 1);
+
+	return 1;
+}
+
 int32_t FmOpenDir(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
-	DEBUG_I("Inside FmOpenDir");
-	int32_t retval = 0;
-	DIR * dir;
-	uint8_t *payload;
+	struct fm_dir *dir = NULL;
+	int32_t retval = -1;
+	int slot;
+	int fd;
 	
 	strcpy(nameBuf, mochaRoot);
 	strcat(nameBuf, (const char *)(rx_packet->reqBuf));
 	DEBUG_I("%s: fName %s", __func__, nameBuf);
-	dir = opendir(nameBuf);
 
-	if(dir)	{
+	for(slot = 0; slot < MAX_OPEN_DIRS; slot++) {
+		if(fm_dirs[slot].fd < 0) {
+			dir = &fm_dirs[slot];
+			break;
+		}
+	}
+
+	if(dir == NULL) {
+		errno = EMFILE;
+		fd = -1;
+	} else {
+		fd = open(nameBuf, O_RDONLY | O_DIRECTORY);
+	}
+
+	if(fd >= 0) {
+		dir->buffer = (uint8_t *) ipc_slab_alloc(FM_DIR_BUFFER_SIZE);
+		if(dir->buffer == NULL) {
+			close(fd);
+			errno = ENOMEM;
+			fd = -1;
+		}
+	}
+
+	if(fd >= 0) {
+		dir->fd = fd;
+		dir->generation = (dir->generation + 1) & FM_HANDLE_GEN_MASK;
+		if(dir->generation == 0)
+			dir->generation = 1;
+		dir->length = dir->offset = 0;
+		dir->eof = 0;
+
+		retval = (dir->generation << FM_HANDLE_GEN_SHIFT) | slot;
 		tx_packet->errorVal = 0;
-		tx_packet->funcRet = dirIndex;
-		
-		dirArray[dirIndex++] = dir;
-		if(dirIndex == MAX_OPEN_DIRS-1)
-			dirIndex = 0;
-	} else {		
+	} else {
 		DEBUG_I("%s: failed to open %s, error: %s", __func__, nameBuf, strerror(errno));
 		tx_packet->errorVal = FmGetLastError();
-		tx_packet->funcRet = -1;
 	}
+	tx_packet->funcRet = retval;
 
 	tx_packet->header.packetLen = sizeof(tx_packet->errorVal) + sizeof(tx_packet->funcRet);
 	tx_packet->respBuf = NULL;
 
-	DEBUG_I("Leaving FmOpenDir");
 	return 0;
 }
 
 int32_t FmCloseDir(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
-	DEBUG_I("Inside FmCloseDir");
-
-	int32_t retval = 0;
-	uint8_t *payload;
-	int32_t fd;
-
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	retval = closedir(dirArray[fd]);
+	int32_t retval = -1;
+	struct fm_dir *dir;
+
+	dir = fm_dir_get(*(int32_t *)(rx_packet->reqBuf));
+	if(dir != NULL) {
+		retval = close(dir->fd);
+		dir->fd = -1;
+		ipc_slab_free(dir->buffer);
+		dir->buffer = NULL;
+	}
 
 	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
 	tx_packet->funcRet = (retval < 0 ? 0 : 1); /* false/true */
@@ -557,30 +2148,37 @@ int32_t FmCloseDir(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 	tx_packet->header.packetLen = sizeof(tx_packet->errorVal) + sizeof(tx_packet->funcRet);
 	tx_packet->respBuf = NULL;
 
-	DEBUG_I("Leaving FmCloseDir");
 	return 0;
 }
 
+/*
+ * Answers with one FmDirEntry, FALSE with no error once the directory is
+ * through. Only getdents64 is batched: nothing confirms the CP would parse
+ * more than one entry in a response.
+ */
 int32_t FmReadDir(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 {
-	int32_t retval = 0;
-	struct dirent * dir;
-	int32_t fd;
+	struct fm_dir *dir;
+	FmDirEntry *entry;
+	int32_t retval = -1;
 
-	fd = *(int32_t *)(rx_packet->reqBuf);
-	fd &= 0xFFF;
-	//dir = readdir((DIR *)dirArray[fd]);
+	dir = fm_dir_get(*(int32_t *)(rx_packet->reqBuf));
 
-	// TODO :
-	// What to return if the directory is not empty?
+	/* The entry is put right where it is sent from, behind the headers */
+	tx_packet->frame = (uint8_t *)ipc_slab_alloc(FM_RESPONSE_HEADROOM + sizeof(FmDirEntry));
+	entry = (FmDirEntry *) (tx_packet->frame + FM_RESPONSE_HEADROOM);
 
-	/* Response has 0x660 bytes + 8bytes header */
-	
-	tx_packet->errorVal = 0;
-	tx_packet->funcRet = 0;
+	if(dir != NULL)
+		retval = fm_dir_next(dir, entry);
 
-	tx_packet->header.packetLen = sizeof(tx_packet->errorVal) + sizeof(tx_packet->funcRet);
-	tx_packet->respBuf = NULL;
+	if(retval < 0)
+		DEBUG_I("%s: error! %s", __func__, strerror(errno));
+
+	tx_packet->errorVal = (retval < 0 ? FmGetLastError() : 0);
+	tx_packet->funcRet = (retval > 0 ? 1 : 0); /* false/true */
+
+	tx_packet->header.packetLen = sizeof(tx_packet->errorVal) + sizeof(tx_packet->funcRet) + (retval > 0 ? sizeof(FmDirEntry) : 0);
+	tx_packet->respBuf = (uint8_t *) entry;
 
 	return 0;
 }
@@ -593,6 +2191,7 @@ int32_t FmCreateDir(struct fmRequest *rx_packet, struct fmResponse *tx_packet)
 	strcat(nameBuf, (const char *)(rx_packet->reqBuf));
 	DEBUG_I("%s: fName %s", __func__, nameBuf);
 
+	fm_stat_invalidate(nameBuf);
 	retval = mkdir(nameBuf, 0777);
 
 	if(retval < 0)
@@ -631,28 +2230,74 @@ int32_t get_request_packet(void *data, struct fmRequest *rx_packet)
 	return 0;
 }
 
-int32_t ipc_parse_fm(struct ipc_client* client, struct modem_io *ipc_frame)
+/* A response whose respBuf is streamed, with its headers kept aside */
+struct fm_response_stream {
+	struct fmResponse *tx_packet;
+	uint8_t headers[FM_RESPONSE_HEADROOM];
+};
+
+static int fm_response_stream_fill(void *data, uint8_t *buffer, uint32_t offset, uint32_t length)
+{
+	struct fm_response_stream *stream = (struct fm_response_stream *) data;
+	uint32_t count;
+
+	if(offset < FM_RESPONSE_HEADROOM) {
+		count = FM_RESPONSE_HEADROOM - offset;
+		if(count > length)
+			count = length;
+
+		memcpy(buffer, stream->headers + offset, count);
+		buffer += count;
+		offset += count;
+		length -= count;
+	}
+
+	if(length == 0)
+		return 0;
+
+	return stream->tx_packet->respFill(stream->tx_packet->respFillData, buffer, offset - FM_RESPONSE_HEADROOM, length);
+}
+
+static int32_t fm_handle_request(struct modem_io *ipc_frame)
 {
 	int32_t retval;
 	struct fmRequest rx_packet;
 	struct fmResponse tx_packet;
+	struct fm_response_stream stream;
 	struct modem_io request;
 	uint8_t *frame;
 	uint8_t *payload;
 	int32_t frame_length;
 
 	get_request_packet(ipc_frame->data, &rx_packet);
+	rx_packet.magic = ipc_frame->magic;
+	rx_packet.cmd = ipc_frame->cmd;
 
 	tx_packet.header = rx_packet.header;
+	tx_packet.respBuf = NULL;
+	tx_packet.frame = NULL;
+	tx_packet.respFill = NULL;
+	tx_packet.respFillData = NULL;
+	tx_packet.respFillEnd = NULL;
+	tx_packet.deferred = 0;
 	retval = fileOps[(tx_packet.header.fmPacketType + 0xEFFFFFFF)](&rx_packet, &tx_packet);
 
+	if(tx_packet.deferred)
+		return 0;
+
     frame_length = (sizeof(struct fmPacketHeader) + tx_packet.header.packetLen);
 
 	request.magic = ipc_frame->magic;
 	request.cmd = ipc_frame->cmd;
 	request.datasize = frame_length;
 
-    frame = (uint8_t*)malloc(frame_length);
+	/* The response data was already put in place */
+	if(tx_packet.frame != NULL)
+		frame = tx_packet.frame;
+	else if(tx_packet.respFill != NULL)
+		frame = stream.headers;
+	else
+		frame = (uint8_t*)ipc_slab_alloc(frame_length);
 
     *(struct fmPacketHeader*)(frame) = tx_packet.header;
 
@@ -662,17 +2307,144 @@ int32_t ipc_parse_fm(struct ipc_client* client, struct modem_io *ipc_frame)
     *(uint32_t*)(payload) = tx_packet.errorVal;
     payload = (payload + sizeof(tx_packet.errorVal));
 
-    memcpy(payload, tx_packet.respBuf, tx_packet.header.packetLen - (sizeof(tx_packet.errorVal) + sizeof(tx_packet.funcRet)));
+	if(tx_packet.respFill != NULL) {
+		stream.tx_packet = &tx_packet;
+		request.data = NULL;
+
+		if(ipc_send_stream(&request, fm_response_stream_fill, &stream) < 0)
+			DEBUG_E("%s: streaming a %d bytes response failed", __func__, frame_length);
+
+		tx_packet.respFillEnd(tx_packet.respFillData);
+
+		return 0;
+	}
+
+	if(tx_packet.frame == NULL)
+		memcpy(payload, tx_packet.respBuf, tx_packet.header.packetLen - (sizeof(tx_packet.errorVal) + sizeof(tx_packet.funcRet)));
 
 	request.data = frame;
 
 	ipc_send(&request);
 
-	if(tx_packet.respBuf != NULL)
-        free(tx_packet.respBuf);
+	if(tx_packet.frame == NULL && tx_packet.respBuf != NULL)
+        ipc_slab_free(tx_packet.respBuf);
 
     if(frame != NULL)
-        free(frame);
+        ipc_slab_free(frame);
 
     return 0;
 }
+
+static void *fm_worker_thread(void *data)
+{
+	struct fm_worker *worker = (struct fm_worker *) data;
+	struct fm_work *work;
+	int slot;
+
+	while(1) {
+		pthread_mutex_lock(&worker->mutex);
+		while(worker->head == NULL)
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+
+		work = worker->head;
+		worker->head = work->next;
+		if(worker->head == NULL)
+			worker->tail = NULL;
+
+		slot = fm_request_slot(&work->frame);
+		if(slot >= 0 && worker->holds[slot] > 0) {
+			work->next = NULL;
+			if(worker->held_tail[slot] != NULL)
+				worker->held_tail[slot]->next = work;
+			else
+				worker->held_head[slot] = work;
+			worker->held_tail[slot] = work;
+			pthread_mutex_unlock(&worker->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&worker->mutex);
+
+		fm_handle_request(&work->frame);
+		ipc_slab_free(work);
+
+		pthread_mutex_lock(&worker->mutex);
+		worker->queued--;
+		worker->done++;
+		pthread_mutex_unlock(&worker->mutex);
+	}
+
+	return NULL;
+}
+
+static void fm_workers_init(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for(i = 0; i < FM_WORKERS; i++) {
+		pthread_mutex_init(&fm_workers[i].mutex, NULL);
+		pthread_cond_init(&fm_workers[i].cond, NULL);
+
+		/* Requests for a worker that couldn't be started are run inline */
+		if(pthread_create(&thread, &attr, fm_worker_thread, (void *) &fm_workers[i]) == 0)
+			fm_workers[i].running = 1;
+		else
+			DEBUG_E("%s: FM worker %d initialization failed", __func__, i);
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+static struct fm_worker *fm_worker_get(struct modem_io *ipc_frame)
+{
+	int slot;
+
+	slot = fm_request_slot(ipc_frame);
+
+	return slot >= 0 ? fm_worker_slot(slot) : &fm_workers[0];
+}
+
+int32_t ipc_parse_fm(struct ipc_client* client, struct modem_io *ipc_frame)
+{
+	struct fm_worker *worker;
+	struct fm_work *work;
+
+	pthread_once(&fm_workers_once, fm_workers_init);
+
+	worker = fm_worker_get(ipc_frame);
+	if(!worker->running)
+		return fm_handle_request(ipc_frame);
+
+	/* The frame data is freed as soon as we return */
+	work = (struct fm_work *) ipc_slab_alloc(sizeof(struct fm_work) + ipc_frame->datasize);
+	if(work == NULL) {
+		/* Run inline, it could overtake the queue and share nameBuf: refuse it */
+		DEBUG_E("%s: no memory to queue the request, failing it", __func__);
+		if(ipc_frame->datasize >= sizeof(struct fmPacketHeader))
+			fm_status_send(ipc_frame->magic, ipc_frame->cmd, (struct fmPacketHeader *) ipc_frame->data, ENOMEM);
+		return -1;
+	}
+
+	work->next = NULL;
+	work->frame = *ipc_frame;
+	work->frame.data = (uint8_t *) (work + 1);
+	memcpy(work->frame.data, ipc_frame->data, ipc_frame->datasize);
+
+	pthread_mutex_lock(&worker->mutex);
+	if(worker->tail != NULL)
+		worker->tail->next = work;
+	else
+		worker->head = work;
+	worker->tail = work;
+	worker->queued++;
+	if(worker->queued > worker->queued_peak)
+		worker->queued_peak = worker->queued;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+
+	return 0;
+}
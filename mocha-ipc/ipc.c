@@ -39,6 +39,7 @@
 #include <asm/types.h>
 
 #include <radio.h>
+#include <slab.h>
 
 #include "ipc_private.h"
 
@@ -396,6 +397,43 @@ int32_t ipc_client_send(struct ipc_client *client, struct modem_io *ipc_frame)
     return client->ops->send(client, ipc_frame);
 }
 
+/*
+ * Sends a frame of ipc_frame->datasize bytes whose data is produced by fill
+ * as it goes out, so that it never has to be held in memory as a whole.
+ * ipc_frame->data is not used.
+ */
+int32_t ipc_client_send_stream(struct ipc_client *client, struct modem_io *ipc_frame,
+                               ipc_stream_fill_cb fill, void *fill_data)
+{
+    struct modem_io frame;
+    int32_t rc;
+
+    if (client == NULL ||
+        client->ops == NULL ||
+        fill == NULL)
+        return -1;
+
+    if (client->ops->send_stream != NULL)
+        return client->ops->send_stream(client, ipc_frame, fill, fill_data);
+
+    /* Devices that can't stream get the whole frame at once */
+    if (client->ops->send == NULL)
+        return -1;
+
+    frame = *ipc_frame;
+    frame.data = (uint8_t *) ipc_slab_alloc(frame.datasize);
+    if (frame.data == NULL)
+        return -1;
+
+    rc = fill(fill_data, frame.data, 0, frame.datasize);
+    if (rc >= 0)
+        rc = client->ops->send(client, &frame);
+
+    ipc_slab_free(frame.data);
+
+    return rc;
+}
+
 int32_t ipc_client_recv(struct ipc_client *client, struct modem_io *ipc_frame)
 {
     if (client == NULL ||
@@ -33,6 +33,7 @@
 #include <bt.h>
 #include <tm.h>
 #include <lbs.h>
+#include <slab.h>
 
 #define LOG_TAG "RIL-Mocha-IPC-PARSER"
 #include <utils/Log.h>
@@ -92,7 +93,7 @@ void ipc_dispatch(struct ipc_client *client, struct modem_io *ipc_frame)
 				multiFrameHeader* mf_header = (multiFrameHeader *)(ipc_frame->data);
 				DEBUG_I("Multi Frame header: Frame type = 0x%x Frame length = 0x%x",
 					mf_header->type, mf_header->size);
-				multi_packet.data = malloc(mf_header->size);
+				multi_packet.data = ipc_slab_alloc(mf_header->size);
 				multi_packet.magic = 0xCAFECAFE;
 				multi_packet.cmd = mf_header->type;
 				multi_packet.datasize = mf_header->size;
@@ -104,7 +105,7 @@ void ipc_dispatch(struct ipc_client *client, struct modem_io *ipc_frame)
 			if (multi_packet.datasize == multiFramePosition)
 			{
 				ipc_dispatch(client, &multi_packet);
-				free(multi_packet.data);
+				ipc_slab_free(multi_packet.data);
 				multiFramePosition = 0;
 			}
 			break;
@@ -30,6 +30,7 @@ struct ipc_ops {
     int32_t (*modem_operations)(struct ipc_client *client, void *data, uint32_t cmd);
     int32_t (*send)(struct ipc_client *client, struct modem_io *);
     int32_t (*recv)(struct ipc_client *client, struct modem_io *);
+    int32_t (*send_stream)(struct ipc_client *client, struct modem_io *, ipc_stream_fill_cb fill, void *fill_data);
 };
 
 struct ipc_handlers {
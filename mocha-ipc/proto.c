@@ -32,6 +32,7 @@
 #include <getopt.h>
 
 #include <radio.h>
+#include <slab.h>
 #include <proto.h>
 
 #define LOG_TAG "RIL-Mocha-PRO"
@@ -95,6 +96,8 @@ void ipc_parse_proto(struct ipc_client* client, struct modem_io *ipc_frame)
 			break;
 		case PROTO_PACKET_MODEM_RRC_CONNECTION_IND:
 			D("PROTO_PACKET_MODEM_RRC_CONNECTION_IND packet received");
+			hex_dump(ipc_frame->data + sizeof(struct protoPacketHeader), ipc_frame->datasize - sizeof(struct protoPacketHeader));
+			ipc_invoke_ril_cb(PROTO_RRC_CONNECTION_IND, (void*)(ipc_frame->data + sizeof(struct protoPacketHeader)));
 			break;
 		default :
 			DEBUG_I("Proto Packet type = 0x%x is not yet handled, len = 0x%x", rx_header->type, ipc_frame->datasize - sizeof(struct protoPacketHeader));
@@ -109,7 +112,7 @@ void proto_send_packet(struct protoPacket* protoReq)
 	struct modem_io request;
 	
 	uint32_t bufLen = protoReq->header.len + sizeof(struct protoPacketHeader);
-	uint8_t* fifobuf = malloc(bufLen);
+	uint8_t* fifobuf = ipc_slab_alloc(bufLen);
 	memcpy(fifobuf, protoReq, sizeof(struct protoPacketHeader));
 	if(protoReq->header.len)
 		memcpy(fifobuf + sizeof(struct protoPacketHeader), protoReq->buf, protoReq->header.len);
@@ -122,7 +125,7 @@ void proto_send_packet(struct protoPacket* protoReq)
 
 	ipc_send(&request);
 
-	free(fifobuf);
+	ipc_slab_free(fifobuf);
 }
 
 void proto_startup(void)
@@ -155,6 +158,16 @@ void proto_stop_network(protoStopNetwork* stopNetwork)
 	proto_send_packet(&pkt);
 }
 
+void proto_stop_rrc_connection(protoRrcConnection* rrcConnection)
+{
+	struct protoPacket pkt;
+	pkt.header.type = PROTO_PACKET_STOP_RRC_CONNECTION;
+	pkt.header.len = sizeof(protoRrcConnection);
+	pkt.buf = (uint8_t*)(rrcConnection);
+	hex_dump(pkt.buf , pkt.header.len);
+	proto_send_packet(&pkt);
+}
+
 void proto_ds_network_resp(uint8_t* buf)
 {
 	struct protoPacket pkt;
@@ -177,17 +190,51 @@ void proto_some_unload_function(uint32_t buf)
 
 void proto_send_data(uint16_t opMode, uint16_t protoType, uint32_t contextId, uint32_t netBufLen, uint8_t *netBuf)
 {
-	protoTransferDataBuf* send_hdr;
-	struct protoPacket pkt;
-	pkt.header.type = PROTO_PACKET_SEND_DATA;
-	pkt.header.len = sizeof(protoTransferDataBuf) + netBufLen;
-	pkt.buf = malloc(sizeof(protoTransferDataBuf) + netBufLen);
-	send_hdr = (protoTransferDataBuf*)pkt.buf;
+	uint8_t *frame;
+
+	frame = ipc_slab_alloc(PROTO_DATA_HEADROOM + netBufLen);
+	if(frame == NULL)
+		return;
+
+	memcpy(frame + PROTO_DATA_HEADROOM, netBuf, netBufLen);
+	proto_send_data_inplace(opMode, protoType, contextId, netBufLen, frame);
+	ipc_slab_free(frame);
+}
+
+/*
+ * frame holds PROTO_DATA_HEADROOM free bytes followed by the netBufLen bytes
+ * of payload. Both headers are written in front of the payload, so the packet
+ * reaches the modem without being copied.
+ */
+void proto_send_data_inplace(uint16_t opMode, uint16_t protoType, uint32_t contextId, uint32_t netBufLen, uint8_t *frame)
+{
+	struct modem_io request;
+
+	proto_prepare_data(opMode, protoType, contextId, netBufLen, frame, &request);
+	ipc_send(&request);
+}
+
+/*
+ * Same as proto_send_data_inplace, but only fills request so that the caller
+ * can send several frames at once
+ */
+void proto_prepare_data(uint16_t opMode, uint16_t protoType, uint32_t contextId, uint32_t netBufLen, uint8_t *frame, struct modem_io *request)
+{
+	struct protoPacketHeader *header;
+	protoTransferDataBuf *send_hdr;
+
+	header = (struct protoPacketHeader *)frame;
+	header->type = PROTO_PACKET_SEND_DATA;
+	header->len = sizeof(protoTransferDataBuf) + netBufLen;
+
+	send_hdr = (protoTransferDataBuf *)(frame + sizeof(struct protoPacketHeader));
 	send_hdr->opMode = opMode;
 	send_hdr->protoType = protoType;
 	send_hdr->contextId = contextId;
 	send_hdr->netBufLen = netBufLen;
-	memcpy(send_hdr->netBuf, netBuf, netBufLen);
-	proto_send_packet(&pkt);
-	free(pkt.buf);
+
+	request->magic = 0xCAFECAFE;
+	request->cmd = FIFO_PKT_PROTO;
+	request->datasize = PROTO_DATA_HEADROOM + netBufLen;
+	request->data = frame;
 }
@@ -36,6 +36,7 @@
 #include <getopt.h>
 
 #include <radio.h>
+#include <slab.h>
 #include <sim.h>
 
 #define LOG_TAG "RIL-Mocha-SIM"
@@ -239,7 +240,7 @@ void sim_send_oem_req(uint8_t* simBuf, uint8_t simBufLen)
 	sim_packet.simBuf = simBuf;
 
 	uint32_t bufLen = sim_packet.header.bufLen + sizeof(struct simPacketHeader);
-	uint8_t* fifobuf = malloc(bufLen);
+	uint8_t* fifobuf = ipc_slab_alloc(bufLen);
 	memcpy(fifobuf, &sim_packet.header, sizeof(struct simPacketHeader));
 	memcpy(fifobuf + sizeof(struct simPacketHeader), sim_packet.simBuf, sim_packet.header.bufLen);
 
@@ -252,7 +253,7 @@ void sim_send_oem_req(uint8_t* simBuf, uint8_t simBufLen)
 
 	ipc_send(&request);
 
-	free(fifobuf);
+	ipc_slab_free(fifobuf);
 }
 
 void sim_send_oem_data(uint8_t hSim, uint8_t packetType, uint8_t* dataBuf, uint32_t oemBufLen)
@@ -265,14 +266,14 @@ void sim_send_oem_data(uint8_t hSim, uint8_t packetType, uint8_t* dataBuf, uint3
 	oem_header.oemBufLen = oemBufLen;
 	
 	uint32_t simBufLen = oemBufLen + sizeof(struct oemSimPacketHeader) + 1; /* Looks like bug in Bada, but there's always 1 redundant, zero byte */
-	uint8_t* simBuf = malloc(simBufLen);
+	uint8_t* simBuf = ipc_slab_alloc(simBufLen);
 	memset(simBuf, 0x00, simBufLen);
 	memcpy(simBuf, &(oem_header), sizeof(struct oemSimPacketHeader));
 	if(oemBufLen)
 		memcpy(simBuf + sizeof(struct oemSimPacketHeader), dataBuf, oemBufLen);
 	
 	sim_send_oem_req(simBuf, simBufLen);
-	free(simBuf);
+	ipc_slab_free(simBuf);
 }
 
 void sim_verify_chv(uint8_t hSim, uint8_t pinType, char* pin)
@@ -365,7 +366,7 @@ void sim_atk_send_packet(uint32_t atkType, uint32_t atkSubType, uint32_t atkBufL
 	uint8_t* fifobuf;
 	uint32_t bufLen = sizeof(sim_atk_packet_header) + atkBufLen;
 
-	fifobuf = malloc(bufLen);
+	fifobuf = ipc_slab_alloc(bufLen);
 	atk_header = (sim_atk_packet_header*)(fifobuf);
 
 	atk_header->atkType = atkType;
@@ -382,7 +383,7 @@ void sim_atk_send_packet(uint32_t atkType, uint32_t atkSubType, uint32_t atkBufL
 
 	ipc_send(&request);
 
-	free(fifobuf);
+	ipc_slab_free(fifobuf);
 }
 
 void sim_read_file_record(uint8_t hSim, simDataRequest *sim_data)
@@ -390,12 +391,12 @@ void sim_read_file_record(uint8_t hSim, simDataRequest *sim_data)
 	//TODO: verify, create and initialize session, send real hSim
 	uint8_t *data;
 
-	data = malloc(sizeof(simDataRequest));
+	data = ipc_slab_alloc(sizeof(simDataRequest));
 	memcpy(data, sim_data, sizeof(simDataRequest));
 
 	DEBUG_I("Sending sim_read_file_record\n");
 	sim_send_oem_data(hSim, SIM_OEM_REQUEST_READ_FILE_RECORD, data, sizeof(simDataRequest));  //why it starts from 4? hell knows
-	free(data);
+	ipc_slab_free(data);
 }
 
 void sim_read_file_binary(uint8_t hSim, simDataRequest *sim_data)
@@ -403,12 +404,12 @@ void sim_read_file_binary(uint8_t hSim, simDataRequest *sim_data)
 	//TODO: verify, create and initialize session, send real hSim
 	uint8_t *data;
 
-	data = malloc(sizeof(simDataRequest));
+	data = ipc_slab_alloc(sizeof(simDataRequest));
 	memcpy(data, sim_data, sizeof(simDataRequest));
 
 	DEBUG_I("Sending sim_read_file_binary\n");
 	sim_send_oem_data(hSim, SIM_OEM_REQUEST_READ_FILE_BINARY, data, sizeof(simDataRequest));  //why it starts from 4? hell knows
-	free(data);
+	ipc_slab_free(data);
 }
 
 void sim_get_file_info(uint8_t hSim, uint16_t simDataType)
@@ -416,13 +417,13 @@ void sim_get_file_info(uint8_t hSim, uint16_t simDataType)
 	//TODO: verify, create and initialize session, send real hSim
 	uint8_t *data;
 
-	data = malloc(sizeof(simDataType));
+	data = ipc_slab_alloc(sizeof(simDataType));
 	memcpy(data,&simDataType,sizeof(simDataType));
 
 	DEBUG_I("Sending sim_get_file_info\n");
 
 	sim_send_oem_data(hSim, SIM_OEM_REQUEST_GET_FILE_INFO, data, sizeof(simDataType)); //why it starts from 4? hell knows
-	free(data);
+	ipc_slab_free(data);
 }
 
 void sim_update_file_record(uint8_t hSim, simUpdateFile *sim_data, uint8_t *dataBuf)
@@ -430,13 +431,13 @@ void sim_update_file_record(uint8_t hSim, simUpdateFile *sim_data, uint8_t *data
 	//TODO: verify, create and initialize session, send real hSim
 	uint8_t *data;
 
-	data = malloc(sizeof(simUpdateFile) + sim_data->bufLen);
+	data = ipc_slab_alloc(sizeof(simUpdateFile) + sim_data->bufLen);
 	memcpy(data, sim_data, sizeof(simUpdateFile));
 	memcpy(data + sizeof(simUpdateFile), dataBuf, sim_data->bufLen);
 
 	DEBUG_I("Sending sim_update_file_record\n");
 	sim_send_oem_data(hSim, SIM_OEM_REQUEST_UPDATE_FILE_RECORD, data, sizeof(simUpdateFile) + sim_data->bufLen + 5);  //why it starts from 4? hell knows
-	free(data);
+	ipc_slab_free(data);
 }
 
 void sim_update_file_binary(uint8_t hSim, simUpdateFile *sim_data, uint8_t *dataBuf)
@@ -444,13 +445,13 @@ void sim_update_file_binary(uint8_t hSim, simUpdateFile *sim_data, uint8_t *data
 	//TODO: verify, create and initialize session, send real hSim
 	uint8_t *data;
 
-	data = malloc(sizeof(simUpdateFile) + sim_data->bufLen);
+	data = ipc_slab_alloc(sizeof(simUpdateFile) + sim_data->bufLen);
 	memcpy(data, sim_data, sizeof(simUpdateFile));
 	memcpy(data + sizeof(simUpdateFile), dataBuf, sim_data->bufLen);
 
 	DEBUG_I("Sending sim_update_file_binary\n");
 	sim_send_oem_data(hSim, SIM_OEM_REQUEST_UPDATE_FILE_BINARY, data, sizeof(simDataRequest) + sim_data->bufLen + 5);  //why it starts from 4? hell knows
-	free(data);
+	ipc_slab_free(data);
 }
 
 void sim_search_file_record(uint8_t hSim, simSearchRecord *sim_data, uint8_t *dataBuf, uint8_t bufLen)
@@ -458,11 +459,11 @@ void sim_search_file_record(uint8_t hSim, simSearchRecord *sim_data, uint8_t *da
 	//TODO: verify, create and initialize session, send real hSim
 	uint8_t *data;
 
-	data = malloc(sizeof(simSearchRecord) + bufLen);
+	data = ipc_slab_alloc(sizeof(simSearchRecord) + bufLen);
 	memcpy(data, sim_data, sizeof(simSearchRecord));
 	memcpy(data + sizeof(simSearchRecord), dataBuf, bufLen);
 
 	DEBUG_I("Sending sim_update_file_binary\n");
 	sim_send_oem_data(hSim, SIM_OEM_REQUEST_SEARCH_RECORD, data, sizeof(simSearchRecord) + bufLen + 5);  //why it starts from 4? hell knows
-	free(data);
+	ipc_slab_free(data);
 }
\ No newline at end of file
@@ -0,0 +1,288 @@
+/**
+ * This file is part of libmocha-ipc.
+ *
+ * libmocha-ipc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libmocha-ipc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libmocha-ipc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <radio.h>
+#include <slab.h>
+
+#define LOG_TAG "RIL-Mocha-SLAB"
+#include <utils/Log.h>
+
+/*
+ * Size-class slab allocator for frames, SRS messages, FM buffers and send
+ * scratch. Each thread keeps a few blocks of every class at hand, the rest
+ * go back to a shared free list that is capped so that RSS stays flat.
+ */
+
+#define IPC_SLAB_MAGIC		0x51AB51AB
+#define IPC_SLAB_OVERSIZED	IPC_SLAB_CLASS_COUNT
+
+struct ipc_slab_block
+{
+	struct ipc_slab_block *next;
+	uint32_t slab_class;
+	uint32_t magic;
+} __attribute__((aligned(8)));
+
+struct ipc_slab_cache
+{
+	struct ipc_slab_block *head[IPC_SLAB_CLASS_COUNT];
+	uint32_t count[IPC_SLAB_CLASS_COUNT];
+};
+
+struct ipc_slab
+{
+	uint32_t size;
+	uint32_t cache_max;	/* per thread */
+	uint32_t free_max;	/* shared */
+	struct ipc_slab_block *free_list;
+	struct ipc_slab_stats stats;
+};
+
+static struct ipc_slab slabs[IPC_SLAB_CLASS_COUNT] = {
+	[IPC_SLAB_HEADER] = { IPC_SLAB_HEADER_SIZE, 32, 256, NULL, { 0 } },
+	[IPC_SLAB_SMALL] = { IPC_SLAB_SMALL_SIZE, 16, 128, NULL, { 0 } },
+	[IPC_SLAB_FRAME] = { IPC_SLAB_FRAME_SIZE, 8, 64, NULL, { 0 } },
+	[IPC_SLAB_LARGE] = { IPC_SLAB_LARGE_SIZE, 1, 4, NULL, { 0 } },
+};
+
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_cache_key;
+
+static void ipc_slab_cache_destroy(void *data)
+{
+	struct ipc_slab_cache *cache = (struct ipc_slab_cache *) data;
+	struct ipc_slab_block *block;
+	int i;
+
+	if(cache == NULL)
+		return;
+
+	pthread_mutex_lock(&slab_mutex);
+	for(i = 0; i < IPC_SLAB_CLASS_COUNT; i++) {
+		while((block = cache->head[i]) != NULL) {
+			cache->head[i] = block->next;
+			if(slabs[i].stats.free < slabs[i].free_max) {
+				block->next = slabs[i].free_list;
+				slabs[i].free_list = block;
+				slabs[i].stats.free++;
+			} else {
+				slabs[i].stats.released++;
+				free(block);
+			}
+		}
+	}
+	pthread_mutex_unlock(&slab_mutex);
+
+	free(cache);
+}
+
+static void ipc_slab_init(void)
+{
+	int i;
+
+	for(i = 0; i < IPC_SLAB_CLASS_COUNT; i++)
+		slabs[i].stats.size = slabs[i].size;
+
+	pthread_key_create(&slab_cache_key, ipc_slab_cache_destroy);
+}
+
+static struct ipc_slab_cache *ipc_slab_cache_get(void)
+{
+	struct ipc_slab_cache *cache;
+
+	pthread_once(&slab_once, ipc_slab_init);
+
+	cache = (struct ipc_slab_cache *) pthread_getspecific(slab_cache_key);
+	if(cache == NULL) {
+		cache = calloc(1, sizeof(struct ipc_slab_cache));
+		if(cache == NULL)
+			return NULL;
+		pthread_setspecific(slab_cache_key, cache);
+	}
+
+	return cache;
+}
+
+static int ipc_slab_class_get(size_t size)
+{
+	int i;
+
+	for(i = 0; i < IPC_SLAB_CLASS_COUNT; i++) {
+		if(size <= slabs[i].size)
+			return i;
+	}
+
+	return IPC_SLAB_OVERSIZED;
+}
+
+static void ipc_slab_account(int slab_class)
+{
+	uint32_t in_use;
+
+	// Counters are atomic so that the thread cache fast path stays lockless
+	in_use = __sync_add_and_fetch(&slabs[slab_class].stats.in_use, 1);
+	if(in_use > slabs[slab_class].stats.in_use_peak)
+		slabs[slab_class].stats.in_use_peak = in_use;
+}
+
+void *ipc_slab_alloc(size_t size)
+{
+	struct ipc_slab_cache *cache;
+	struct ipc_slab_block *block = NULL;
+	int slab_class;
+
+	slab_class = ipc_slab_class_get(size);
+
+	if(slab_class == IPC_SLAB_OVERSIZED) {
+		block = malloc(sizeof(struct ipc_slab_block) + size);
+		if(block == NULL)
+			return NULL;
+
+		__sync_add_and_fetch(&slabs[IPC_SLAB_LARGE].stats.oversized, 1);
+		goto done;
+	}
+
+	cache = ipc_slab_cache_get();
+	if(cache != NULL && cache->head[slab_class] != NULL) {
+		block = cache->head[slab_class];
+		cache->head[slab_class] = block->next;
+		cache->count[slab_class]--;
+		goto account;
+	}
+
+	pthread_mutex_lock(&slab_mutex);
+	block = slabs[slab_class].free_list;
+	if(block != NULL) {
+		slabs[slab_class].free_list = block->next;
+		slabs[slab_class].stats.free--;
+	}
+	pthread_mutex_unlock(&slab_mutex);
+
+	if(block == NULL) {
+		block = malloc(sizeof(struct ipc_slab_block) + slabs[slab_class].size);
+		if(block == NULL) {
+			DEBUG_E("%s: out of memory for class %d", __func__, slab_class);
+			return NULL;
+		}
+		__sync_add_and_fetch(&slabs[slab_class].stats.created, 1);
+	}
+
+account:
+	ipc_slab_account(slab_class);
+
+done:
+	block->next = NULL;
+	block->slab_class = slab_class;
+	block->magic = IPC_SLAB_MAGIC;
+
+	return (void *) (block + 1);
+}
+
+void *ipc_slab_calloc(size_t size)
+{
+	void *ptr;
+
+	ptr = ipc_slab_alloc(size);
+	if(ptr != NULL)
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+void ipc_slab_free(void *ptr)
+{
+	struct ipc_slab_cache *cache;
+	struct ipc_slab_block *block;
+	int slab_class;
+
+	if(ptr == NULL)
+		return;
+
+	block = ((struct ipc_slab_block *) ptr) - 1;
+	if(block->magic != IPC_SLAB_MAGIC) {
+		DEBUG_E("%s: %p was not allocated from a slab", __func__, ptr);
+		return;
+	}
+
+	block->magic = 0;
+	slab_class = block->slab_class;
+
+	if(slab_class == IPC_SLAB_OVERSIZED) {
+		free(block);
+		return;
+	}
+
+	__sync_sub_and_fetch(&slabs[slab_class].stats.in_use, 1);
+
+	cache = ipc_slab_cache_get();
+	if(cache != NULL && cache->count[slab_class] < slabs[slab_class].cache_max) {
+		block->next = cache->head[slab_class];
+		cache->head[slab_class] = block;
+		cache->count[slab_class]++;
+		return;
+	}
+
+	pthread_mutex_lock(&slab_mutex);
+	if(slabs[slab_class].stats.free < slabs[slab_class].free_max) {
+		block->next = slabs[slab_class].free_list;
+		slabs[slab_class].free_list = block;
+		slabs[slab_class].stats.free++;
+		block = NULL;
+	} else {
+		slabs[slab_class].stats.released++;
+	}
+	pthread_mutex_unlock(&slab_mutex);
+
+	if(block != NULL)
+		free(block);
+}
+
+int ipc_slab_get_stats(int slab_class, struct ipc_slab_stats *stats)
+{
+	if(slab_class < 0 || slab_class >= IPC_SLAB_CLASS_COUNT || stats == NULL)
+		return -1;
+
+	pthread_once(&slab_once, ipc_slab_init);
+
+	pthread_mutex_lock(&slab_mutex);
+	memcpy(stats, &slabs[slab_class].stats, sizeof(struct ipc_slab_stats));
+	pthread_mutex_unlock(&slab_mutex);
+
+	return 0;
+}
+
+void ipc_slab_dump_stats(void)
+{
+	struct ipc_slab_stats stats;
+	int i;
+
+	for(i = 0; i < IPC_SLAB_CLASS_COUNT; i++) {
+		if(ipc_slab_get_stats(i, &stats) < 0)
+			continue;
+
+		DEBUG_I("slab 0x%x: in use %u (peak %u), free %u, created %u, released %u, oversized %u",
+			stats.size, stats.in_use, stats.in_use_peak, stats.free,
+			stats.created, stats.released, stats.oversized);
+	}
+}
@@ -32,6 +32,7 @@
 #include <getopt.h>
 
 #include <radio.h>
+#include <slab.h>
 #include <tapi.h>
 #include <tapi_call.h>
 #include <tapi_nettext.h>
@@ -108,7 +109,7 @@ void tapi_send_packet(struct tapiPacket* tapiReq)
 	struct modem_io request;
 	
 	uint32_t bufLen = tapiReq->header.len + sizeof(struct tapiPacketHeader);
-	uint8_t* fifobuf = malloc(bufLen);
+	uint8_t* fifobuf = ipc_slab_alloc(bufLen);
 	memcpy(fifobuf, tapiReq, sizeof(struct tapiPacketHeader));
 	if(tapiReq->header.len)
 		memcpy(fifobuf + sizeof(struct tapiPacketHeader), tapiReq->buf, tapiReq->header.len);
@@ -121,7 +122,7 @@ void tapi_send_packet(struct tapiPacket* tapiReq)
 
 	ipc_send(&request);
 
-	free(fifobuf);
+	ipc_slab_free(fifobuf);
 }
 
 void tapi_init(void)
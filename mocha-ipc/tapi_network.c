@@ -154,6 +154,16 @@ void tapi_network_search(void)
 	tapi_send_packet(&pkt);
 }
 
+/*
+ * No dedicated abort opcode is known for TAPI_NETWORK_SEARCH, setting the
+ * selection mode again (set to 1 before searching) is the closest we have.
+ * mode is the one in use before the search, so that it isn't changed.
+ */
+void tapi_network_search_abort(uint8_t mode)
+{
+	tapi_set_selection_mode(mode);
+}
+
 void tapi_set_selection_mode(uint8_t mode)
 {
 	struct tapiPacket pkt;
@@ -26,6 +26,7 @@
 #include <utils/Log.h>
 
 #include "mocha-ril.h"
+#include "util.h"
 #include <tapi_call.h>
 
 ril_call_context* find_active_call()
@@ -50,6 +51,7 @@ ril_call_context* new_ril_call_context()
 		if(!ril_data.calls[i])
 		{
 			ril_data.calls[i] = calloc(1, sizeof(ril_call_context));
+			gprs_uplink_hold_update();
 			return ril_data.calls[i];
 		}
 	}
@@ -80,6 +82,7 @@ void release_ril_call_context(ril_call_context* ptr)
 		{
 			free(ril_data.calls[i]);
 			ril_data.calls[i] = NULL;
+			gprs_uplink_hold_update();
 			return;
 		}
 	}
@@ -373,12 +376,19 @@ void ril_request_get_current_calls(RIL_Token t)
 {
 	int i, j;
 
-	RIL_Call **calls = NULL;
+	RIL_Call **calls;
+	calls = (RIL_Call **) ril_arena_alloc(MAX_CALLS * sizeof(RIL_Call *));
+	if (calls == NULL) {
+		ril_request_complete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+		return;
+	}
 	j = 0;
 	for (i = 0; i < MAX_CALLS; i++) {
 		if(ril_data.calls[i] == NULL || ril_data.calls[i]->callId == 0xFF)
 			continue;
-		RIL_Call *call = (RIL_Call *) malloc(sizeof(RIL_Call));
+		RIL_Call *call = (RIL_Call *) ril_arena_alloc(sizeof(RIL_Call));
+		if (call == NULL)
+			break;
 		call->state = ril_data.calls[i]->call_state;
 		call->index = i + 1;
 		call->toa = (strlen(ril_data.calls[i]->number) > 0 && ril_data.calls[i]->number[0] == '+') ? 145 : 129;
@@ -392,17 +402,10 @@ void ril_request_get_current_calls(RIL_Token t)
 		call->name = NULL;
 		call->namePresentation = 2;
 		call->uusInfo = NULL;
-		calls = (RIL_Call **) realloc(calls, (j + 1) * sizeof(RIL_Call *));
 		calls[j++] = call;
 	}
 
-	ril_request_complete(t, RIL_E_SUCCESS, calls, (j * sizeof(RIL_Call *)));
-
-	for (i = 0; i < j; i++) {
-		free(calls[i]);
-	}
-	if(calls)
-		free(calls);
+	ril_request_complete(t, RIL_E_SUCCESS, j > 0 ? calls : NULL, (j * sizeof(RIL_Call *)));
 }
 
 void ril_request_hangup(RIL_Token t, void *data, size_t datalen)
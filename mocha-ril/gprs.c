@@ -22,6 +22,12 @@
  */
 
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <time.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -32,19 +38,24 @@
 #define LOG_TAG "RIL-Mocha-GPRS"
 #include <utils/Log.h>
 #include <cutils/properties.h>
-#include <netutils/ifc.h>
 
 #include "mocha-ril.h"
 #include "util.h"
 #include <proto.h>
-
-// libnetutils missing prototype
-extern int ifc_configure(const char *ifname,
-	in_addr_t address,
-	in_addr_t netmask,
-	in_addr_t gateway,
-	in_addr_t dns1,
-	in_addr_t dns2);
+#include <slab.h>
+
+#define GPRS_MTU		1500
+#define GPRS_UPLINK_BATCH	8
+#define GPRS_UPLINK_SMALL	128	/* bytes, sent ahead of bulk data */
+#define GPRS_UPLINK_QUEUE_BYTES	(32 * GPRS_MTU)	/* tun is not read beyond this */
+#define GPRS_UPLINK_LIMIT_MIN	(2 * GPRS_MTU)
+#define GPRS_UPLINK_LIMIT_MAX	(16 * GPRS_MTU)
+#define GPRS_UPLINK_SLOT	10000	/* us between two limited rounds */
+#define GPRS_UPLINK_SLOW	2000	/* us, a round taking longer means the CP is backing up */
+#define GPRS_STATS_WINDOW	1000000	/* us over which a throughput sample is taken */
+#define GPRS_STATS_EWMA_SHIFT	2	/* each sample weighs 1/4 */
+#define GPRS_DORMANCY_TICK	1000	/* ms between two idleness checks */
+#define GPRS_DORMANCY_BACKOFF_MAX	60000	/* ms */
 
 struct in_addr htoina(uint32_t addr)
 {
@@ -76,222 +87,1152 @@ uint8_t data_call_type_to_proto_type(char* type)
 		return PROTO_TYPE_NONE;
 }
 
-void *gprs_tunneling_thread(void *data)
+/*
+ * Sorts an uplink IP packet into a class: pure TCP ACKs, DNS and other small
+ * packets overtake bulk data so that downloads and lookups don't stall behind
+ * full size segments of an upload.
+ */
+static int gprs_uplink_classify(uint8_t *packet, int length, uint32_t *flags)
+{
+	int header_len, l4_len, protocol;
+	uint8_t *l4;
+
+	*flags = 0;
+
+	/* Too short to be parsed, but small anyway */
+	if(length < 20)
+		return GPRS_UPLINK_PRIO;
+
+	switch(packet[0] >> 4) {
+		case 4:
+			header_len = (packet[0] & 0x0F) * 4;
+			protocol = packet[9];
+			/* Only the first fragment carries the ports */
+			if((((packet[6] & 0x1F) << 8) | packet[7]) != 0)
+				return length <= GPRS_UPLINK_SMALL ? GPRS_UPLINK_PRIO : GPRS_UPLINK_BULK;
+			break;
+		case 6:
+			header_len = 40;
+			protocol = packet[6];
+			break;
+		default:
+			return length <= GPRS_UPLINK_SMALL ? GPRS_UPLINK_PRIO : GPRS_UPLINK_BULK;
+	}
+
+	if(header_len < 20 || length < header_len + 8)
+		return length <= GPRS_UPLINK_SMALL ? GPRS_UPLINK_PRIO : GPRS_UPLINK_BULK;
+
+	l4 = packet + header_len;
+	l4_len = length - header_len;
+
+	switch(protocol) {
+		case IPPROTO_TCP:
+			/* ACK set, no SYN, FIN or RST, no payload */
+			if(l4_len >= 20 && (l4[13] & 0x17) == 0x10 && l4_len == (l4[12] >> 4) * 4) {
+				*flags |= GPRS_UPLINK_INTERACTIVE;
+				return GPRS_UPLINK_PRIO;
+			}
+			break;
+		case IPPROTO_UDP:
+			if(((l4[0] << 8) | l4[1]) == 53 || ((l4[2] << 8) | l4[3]) == 53) {
+				*flags |= GPRS_UPLINK_INTERACTIVE;
+				return GPRS_UPLINK_PRIO;
+			}
+			break;
+	}
+
+	return length <= GPRS_UPLINK_SMALL ? GPRS_UPLINK_PRIO : GPRS_UPLINK_BULK;
+}
+
+static uint64_t gprs_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Accounts a packet that made it through in one direction and folds the
+ * bytes of every elapsed GPRS_STATS_WINDOW into the throughput average
+ */
+static void gprs_stats_account(struct ril_gprs_stats *stats, int direction, uint32_t length, uint64_t now)
+{
+	uint64_t elapsed;
+	int64_t sample;
+
+	stats->packets[direction]++;
+	stats->bytes[direction] += length;
+	stats->window_bytes[direction] += length;
+
+	if(stats->window_start[direction] == 0)
+		stats->window_start[direction] = now;
+
+	elapsed = now - stats->window_start[direction];
+	if(elapsed < GPRS_STATS_WINDOW)
+		return;
+
+	sample = (int64_t) (stats->window_bytes[direction] * 1000000 / elapsed);
+	stats->rate[direction] += (int32_t) ((sample - (int64_t) stats->rate[direction]) >> GPRS_STATS_EWMA_SHIFT);
+	stats->window_start[direction] = now;
+	stats->window_bytes[direction] = 0;
+}
+
+/*
+ * The average is only updated when traffic flows, decay it for the windows
+ * that went by idle since
+ */
+static uint32_t gprs_stats_rate(struct ril_gprs_stats *stats, int direction, uint64_t now)
+{
+	uint64_t rate = stats->rate[direction];
+	uint64_t idle;
+
+	if(stats->window_start[direction] == 0 || now < stats->window_start[direction])
+		return (uint32_t) rate;
+
+	idle = (now - stats->window_start[direction]) / GPRS_STATS_WINDOW;
+	while(idle-- > 1 && rate > 0)
+		rate -= rate >> GPRS_STATS_EWMA_SHIFT ? rate >> GPRS_STATS_EWMA_SHIFT : rate;
+
+	return (uint32_t) rate;
+}
+
+static int gprs_stats_latency_bucket(uint64_t latency)
+{
+	int bucket = 0;
+
+	latency >>= 7;
+	while(latency > 0 && bucket < GPRS_STATS_LATENCY_BUCKETS - 1) {
+		latency >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+static void gprs_uplink_init(struct ril_gprs_uplink *uplink)
+{
+	int i;
+
+	memset(uplink, 0, sizeof(struct ril_gprs_uplink));
+	for(i = 0; i < GPRS_UPLINK_CLASS_COUNT; i++)
+		list_head_init(&uplink->queue[i]);
+
+	uplink->limit = GPRS_UPLINK_LIMIT_MIN;
+}
+
+static uint32_t gprs_uplink_sojourn_avg(struct ril_gprs_uplink *uplink)
 {
+	uint32_t packets;
+
+	packets = uplink->packets[GPRS_UPLINK_PRIO] + uplink->packets[GPRS_UPLINK_BULK];
+	if(packets == 0)
+		return 0;
+
+	return (uint32_t) (uplink->sojourn_total / packets);
+}
+
+static void gprs_uplink_flush(struct ril_gprs_connection *gprs_connection)
+{
+	struct ril_gprs_uplink *uplink = &gprs_connection->uplink;
+	struct ril_gprs_uplink_packet *packet, *tmp;
+	int i;
+
+	for(i = 0; i < GPRS_UPLINK_CLASS_COUNT; i++) {
+		list_for_each_entry_safe(packet, tmp, &uplink->queue[i], list) {
+			list_del(&packet->list);
+			ipc_slab_free(packet);
+			gprs_connection->stats.dropped[GPRS_STATS_UPLINK]++;
+		}
+	}
+	uplink->queued = 0;
+	uplink->queued_bytes = 0;
+	uplink->interactive = 0;
+}
+
+static int gprs_call_active(void)
+{
+	int i;
+
+	for(i = 0; i < MAX_CALLS; i++) {
+		if(ril_data.calls[i] != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Set by the RIL thread while the screen is off and no call is up, read by
+ * the tunneling threads, which must not look at ril_data.state or calls
+ */
+static int gprs_uplink_holdable;
+
+/*
+ * Has to be called with RIL_LOCK held, whenever the screen state or the
+ * calls change
+ */
+void gprs_uplink_hold_update(void)
+{
+	int holdable;
+
+	holdable = ril_data.state.screen_off && !gprs_call_active();
+
+	/* Send whatever uplink data was held back */
+	if(__sync_lock_test_and_set(&gprs_uplink_holdable, holdable) && !holdable)
+		gprs_uplink_kick();
+}
+
+/*
+ * While the screen is off, background uplink data is held back for up to
+ * uplinkHoldMs or until uplinkHoldBytes are queued and then sent as one burst,
+ * so that the link to the CP wakes up once instead of for every packet.
+ * TCP ACKs, DNS and anything queued during a call are not held.
+ * Returns how long the queue still has to be held in us, 0 if it can go.
+ */
+static uint64_t gprs_uplink_hold(struct ril_gprs_uplink *uplink, uint64_t now)
+{
+	uint64_t deadline;
+
+	if(ril_data.config.uplinkHoldMs == 0 || !__sync_add_and_fetch(&gprs_uplink_holdable, 0))
+		return 0;
+
+	if(uplink->interactive > 0 || uplink->queued_bytes >= GPRS_UPLINK_QUEUE_BYTES)
+		return 0;
+
+	if(ril_data.config.uplinkHoldBytes > 0 && uplink->queued_bytes >= ril_data.config.uplinkHoldBytes)
+		return 0;
+
+	deadline = uplink->hold_start + (uint64_t) ril_data.config.uplinkHoldMs * 1000;
+
+	return deadline > now ? deadline - now : 0;
+}
+
+/*
+ * Wakes up all tunneling threads so that held uplink data is sent now
+ */
+void gprs_uplink_kick(void)
+{
+	struct ril_gprs_connection *gprs_connection;
+	uint64_t event = 1;
+
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list) {
+		if(gprs_connection->thread_state == 1)
+			write(gprs_connection->event_fd, &event, sizeof(event));
+	}
+}
+
+/*
+ * Reads from the tun device until it runs dry or the queue holds
+ * GPRS_UPLINK_QUEUE_BYTES. Past that the device is left alone, so that
+ * packets back up in the kernel instead of in the CP.
+ * Returns -1 when the device failed
+ */
+static int gprs_uplink_fill(struct ril_gprs_connection *gprs_connection)
+{
+	struct ril_gprs_uplink *uplink = &gprs_connection->uplink;
+	struct ril_gprs_uplink_packet *packet;
+	int class;
 	int n;
-	uint8_t buf[1500]; //MTU is 1500
+
+	while(uplink->queued_bytes < GPRS_UPLINK_QUEUE_BYTES) {
+		packet = ipc_slab_alloc(sizeof(struct ril_gprs_uplink_packet) + PROTO_DATA_HEADROOM + GPRS_MTU);
+		if(packet == NULL)
+			return 0;
+
+		n = read(gprs_connection->iface, packet->frame + PROTO_DATA_HEADROOM, GPRS_MTU);
+		if(n <= 0) {
+			ipc_slab_free(packet);
+			if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				ALOGE("%s: Couldn't read from %s, errno: %d", __func__, gprs_connection->ifname, errno);
+				gprs_connection->stats.errors[GPRS_STATS_UPLINK]++;
+				return -1;
+			}
+			return 0;
+		}
+
+		packet->length = n;
+		packet->enqueued = gprs_time_us();
+		class = gprs_uplink_classify(packet->frame + PROTO_DATA_HEADROOM, n, &packet->flags);
+
+		if(uplink->queued == 0)
+			uplink->hold_start = packet->enqueued;
+		if(packet->flags & GPRS_UPLINK_INTERACTIVE)
+			uplink->interactive++;
+
+		list_add_tail(&packet->list, &uplink->queue[class]);
+		uplink->queued++;
+		uplink->queued_bytes += n;
+		if(uplink->queued_bytes > uplink->queued_bytes_peak)
+			uplink->queued_bytes_peak = uplink->queued_bytes;
+		uplink->packets[class]++;
+		uplink->bytes[class] += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Hands at most uplink->limit bytes of queued packets to the modem, highest
+ * class first. Like BQL, the limit follows how fast the modem takes them:
+ * it grows while rounds are cut short by it and complete quickly, and
+ * shrinks as soon as a round is slow. A round cut short by the limit delays
+ * the next one by GPRS_UPLINK_SLOT.
+ */
+static void gprs_uplink_xmit(struct ril_gprs_connection *gprs_connection)
+{
+	struct ril_gprs_uplink *uplink = &gprs_connection->uplink;
+	struct ril_gprs_stats *stats = &gprs_connection->stats;
+	struct ril_gprs_uplink_packet *packets[GPRS_UPLINK_BATCH];
+	struct modem_io requests[GPRS_UPLINK_BATCH];
+	uint64_t start, now;
+	uint32_t sojourn;
+	uint32_t sent = 0;
+	int class = 0;
+	int count, done, i;
+
+	start = gprs_time_us();
+
+	while(uplink->queued > 0 && sent < uplink->limit) {
+		for(count = 0; count < GPRS_UPLINK_BATCH && class < GPRS_UPLINK_CLASS_COUNT && sent < uplink->limit; ) {
+			packets[count] = list_first_entry(&uplink->queue[class], struct ril_gprs_uplink_packet, list);
+			if(packets[count] == NULL) {
+				class++;
+				continue;
+			}
+
+			list_del(&packets[count]->list);
+			uplink->queued--;
+			uplink->queued_bytes -= packets[count]->length;
+			if(packets[count]->flags & GPRS_UPLINK_INTERACTIVE)
+				uplink->interactive--;
+			sent += packets[count]->length;
+
+			sojourn = start - packets[count]->enqueued;
+			uplink->sojourn_total += sojourn;
+			if(sojourn > uplink->sojourn_max)
+				uplink->sojourn_max = sojourn;
+
+			proto_prepare_data(PROTO_OPMODE_PS, gprs_connection->type, gprs_connection->contextId,
+				packets[count]->length, packets[count]->frame, &requests[count]);
+			count++;
+		}
+
+		ALOGV("%s: Tunneling %d net frames from %s to CP", __func__, count, gprs_connection->ifname);
+		done = ipc_send_batch(requests, count);
+		stats->errors[GPRS_STATS_UPLINK] += count - done;
+
+		now = gprs_time_us();
+		for(i = 0; i < count; i++) {
+			if(i < done) {
+				gprs_stats_account(stats, GPRS_STATS_UPLINK, packets[i]->length, now);
+				stats->latency[gprs_stats_latency_bucket(now - packets[i]->enqueued)]++;
+			}
+			ipc_slab_free(packets[i]);
+		}
+	}
+
+	now = gprs_time_us();
+
+	if(now - start > GPRS_UPLINK_SLOW) {
+		uplink->limit -= uplink->limit / 4;
+		if(uplink->limit < GPRS_UPLINK_LIMIT_MIN)
+			uplink->limit = GPRS_UPLINK_LIMIT_MIN;
+	} else if(uplink->queued > 0 && uplink->limit < GPRS_UPLINK_LIMIT_MAX) {
+		uplink->limit += GPRS_MTU;
+	}
+
+	if(uplink->queued > 0) {
+		uplink->throttled++;
+		uplink->next_xmit = now + GPRS_UPLINK_SLOT;
+	} else {
+		uplink->next_xmit = now;
+	}
+}
+
+void *gprs_tunneling_thread(void *data)
+{
 	ril_gprs_connection *gprs_connection = (ril_gprs_connection *)data;
-    fd_set fds;
-	struct timeval select_timeout;
+	struct ril_gprs_uplink *uplink = &gprs_connection->uplink;
+	struct pollfd fds[2];
+	uint64_t now, wait, hold;
+	uint64_t event;
+	int timeout;
+	int n;
+
+	fds[0].fd = gprs_connection->iface;
+	fds[1].fd = gprs_connection->event_fd;
+	fds[1].events = POLLIN;
 
 	ALOGD("%s: Thread initialized for connection cid %d, contextId %d on %s", __func__, 
 		gprs_connection->cid, gprs_connection->contextId, gprs_connection->ifname);
 	while(1)
-	{		
-		pthread_mutex_lock(&gprs_connection->mutex);
-		FD_ZERO(&fds);
-		FD_SET(gprs_connection->iface, &fds);
-		select_timeout.tv_sec = 0;
-		select_timeout.tv_usec = 300000; //300ms select timeout
-		select(gprs_connection->iface+1, &fds, NULL, NULL, &select_timeout);
-		if(gprs_connection->thread_state == 2)
-		{			
-			pthread_mutex_unlock(&gprs_connection->mutex);
-			pthread_exit(NULL);
-			return NULL;
+	{
+		/* Wait for the next round only while something is queued */
+		timeout = -1;
+		if(uplink->queued > 0) {
+			now = gprs_time_us();
+			wait = uplink->next_xmit > now ? uplink->next_xmit - now : 0;
+			hold = gprs_uplink_hold(uplink, now);
+			if(hold > wait)
+				wait = hold;
+			timeout = (int) ((wait + 999) / 1000);
+		}
+
+		/* A full queue pushes back on the tun device */
+		fds[0].events = uplink->queued_bytes < GPRS_UPLINK_QUEUE_BYTES ? POLLIN : 0;
+
+		n = poll(fds, 2, timeout);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			ALOGE("%s: poll failed, errno: %d", __func__, errno);
+			break;
+		}
+
+		/* Woken up by gprs_stop_tunneling_thread or gprs_uplink_kick */
+		if(fds[1].revents & POLLIN) {
+			read(gprs_connection->event_fd, &event, sizeof(event));
+			if(gprs_connection->thread_state == 2)
+				break;
 		}
-		if(FD_ISSET(gprs_connection->iface, &fds)) {
-			n = read(gprs_connection->iface, buf, 1500);
-			RIL_LOCK();
-			ALOGV("%s: Tunneling %d bytes of the net frame from %s to CP", __func__, n, gprs_connection->ifname);
-			proto_send_data(PROTO_OPMODE_PS, gprs_connection->type, gprs_connection->contextId, n, buf);
-			RIL_UNLOCK();
-		}		
-		pthread_mutex_unlock(&gprs_connection->mutex);
+
+		if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			ALOGE("%s: %s went away", __func__, gprs_connection->ifname);
+			break;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			if(gprs_uplink_fill(gprs_connection) < 0)
+				break;
+		}
+
+		now = gprs_time_us();
+		if(uplink->queued > 0 && now >= uplink->next_xmit && gprs_uplink_hold(uplink, now) == 0)
+			gprs_uplink_xmit(gprs_connection);
 	}
+
+	gprs_uplink_flush(gprs_connection);
+
+	return NULL;
 }
 
 int gprs_start_tunneling_thread(struct ril_gprs_connection *gprs_connection)
 {
-	pthread_attr_t attr;
+	int flags;
 	int rd;
 
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	rd = pthread_create(&gprs_connection->thread, &attr, gprs_tunneling_thread, (void *) gprs_connection);
+	/* The thread drains the tun device until EAGAIN */
+	flags = fcntl(gprs_connection->iface, F_GETFL);
+	if(flags < 0 || fcntl(gprs_connection->iface, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+
+	gprs_connection->event_fd = eventfd(0, 0);
+	if(gprs_connection->event_fd < 0)
+		return -1;
+
+	gprs_uplink_init(&gprs_connection->uplink);
+
+	rd = pthread_create(&gprs_connection->thread, NULL, gprs_tunneling_thread, (void *) gprs_connection);
 	if(rd == 0)
 	{
 		gprs_connection->thread_state = 1;
 	}
+	else
+	{
+		close(gprs_connection->event_fd);
+		gprs_connection->event_fd = -1;
+	}
 	return rd;
 }
 
 int gprs_stop_tunneling_thread(struct ril_gprs_connection *gprs_connection)
 {
+	uint64_t event = 1;
+
 	if(gprs_connection->thread_state == 1)
 	{
 		gprs_connection->thread_state = 2;
-		pthread_mutex_lock(&gprs_connection->mutex);
-		pthread_mutex_unlock(&gprs_connection->mutex);
+		write(gprs_connection->event_fd, &event, sizeof(event));
+		pthread_join(gprs_connection->thread, NULL);
+
+		ALOGD("%s: %s uplink: %u prio packets (%llu bytes), %u bulk packets (%llu bytes)", __func__, gprs_connection->ifname,
+			gprs_connection->uplink.packets[GPRS_UPLINK_PRIO], (unsigned long long) gprs_connection->uplink.bytes[GPRS_UPLINK_PRIO],
+			gprs_connection->uplink.packets[GPRS_UPLINK_BULK], (unsigned long long) gprs_connection->uplink.bytes[GPRS_UPLINK_BULK]);
+		ALOGD("%s: %s uplink queue: peak %u bytes, sojourn avg %u us max %u us, limit %u bytes, %u throttled rounds", __func__, gprs_connection->ifname,
+			gprs_connection->uplink.queued_bytes_peak, gprs_uplink_sojourn_avg(&gprs_connection->uplink),
+			gprs_connection->uplink.sojourn_max, gprs_connection->uplink.limit, gprs_connection->uplink.throttled);
+
+		close(gprs_connection->event_fd);
+		gprs_connection->event_fd = -1;
+		gprs_connection->thread_state = 0;
 		return 0;
 	}
-	return -1;
+	return -1;
+}
+
+/*
+ * Downlink fast path: PROTO data frames are matched against this table right
+ * after they were received and handed to the connection's writer thread,
+ * without going through ipc_dispatch or taking RIL_LOCK. Slots are published
+ * and cleared with atomic operations; the modem reader is the only thread
+ * that looks entries up, so clearing a slot only has to wait for it to leave
+ * gprs_downlink_dispatch.
+ */
+
+#define GPRS_DOWNLINK_SLOTS	8
+
+static struct ril_gprs_connection *gprs_downlink_table[GPRS_DOWNLINK_SLOTS];
+static volatile uint32_t gprs_downlink_readers;
+
+static struct ril_gprs_connection *gprs_downlink_lookup(uint32_t contextId)
+{
+	struct ril_gprs_connection *gprs_connection;
+	int i;
+
+	for(i = 0; i < GPRS_DOWNLINK_SLOTS; i++) {
+		gprs_connection = gprs_downlink_table[(contextId + i) % GPRS_DOWNLINK_SLOTS];
+		if(gprs_connection != NULL && gprs_connection->contextId == contextId)
+			return gprs_connection;
+	}
+
+	return NULL;
+}
+
+static int gprs_downlink_publish(struct ril_gprs_connection *gprs_connection)
+{
+	int slot;
+	int i;
+
+	for(i = 0; i < GPRS_DOWNLINK_SLOTS; i++) {
+		slot = (gprs_connection->contextId + i) % GPRS_DOWNLINK_SLOTS;
+		if(__sync_bool_compare_and_swap(&gprs_downlink_table[slot], NULL, gprs_connection))
+			return 0;
+	}
+
+	return -1;
+}
+
+static void gprs_downlink_unpublish(struct ril_gprs_connection *gprs_connection)
+{
+	int i;
+
+	for(i = 0; i < GPRS_DOWNLINK_SLOTS; i++)
+		__sync_bool_compare_and_swap(&gprs_downlink_table[i], gprs_connection, NULL);
+
+	/* Wait for the modem reader to drop any reference it still holds */
+	while(__sync_add_and_fetch(&gprs_downlink_readers, 0) != 0)
+		sched_yield();
+}
+
+static int gprs_downlink_queue(struct ril_gprs_connection *gprs_connection, uint8_t *frame, uint8_t *payload, uint32_t length)
+{
+	struct ril_gprs_downlink *downlink = &gprs_connection->downlink;
+	struct ril_gprs_downlink_frame *entry;
+	uint64_t event = 1;
+
+	if(downlink->head - downlink->tail >= GPRS_DOWNLINK_RING) {
+		gprs_connection->stats.dropped[GPRS_STATS_DOWNLINK]++;
+		return -1;
+	}
+
+	entry = &downlink->ring[downlink->head % GPRS_DOWNLINK_RING];
+	entry->frame = frame;
+	entry->payload = payload;
+	entry->length = length;
+
+	__sync_synchronize();
+	downlink->head++;
+
+	write(downlink->event_fd, &event, sizeof(event));
+
+	return 0;
+}
+
+/*
+ * Called by the modem reader for every received frame. Returns 0 when the
+ * frame was a downlink data frame, which is then owned by this function, or
+ * -1 when it has to go through ipc_dispatch.
+ */
+int gprs_downlink_dispatch(struct modem_io *ipc_frame)
+{
+	struct ril_gprs_connection *gprs_connection;
+	struct protoPacketHeader *rx_header;
+	protoTransferDataBuf *rcvData;
+
+	if(ipc_frame->cmd != FIFO_PKT_PROTO || ipc_frame->data == NULL || ipc_frame->datasize < PROTO_DATA_HEADROOM)
+		return -1;
+
+	rx_header = (struct protoPacketHeader *) ipc_frame->data;
+	if(rx_header->type != PROTO_PACKET_RECEIVE_DATA_IND)
+		return -1;
+
+	rcvData = (protoTransferDataBuf *) (ipc_frame->data + sizeof(struct protoPacketHeader));
+	if(rcvData->netBufLen > ipc_frame->datasize - PROTO_DATA_HEADROOM) {
+		ALOGE("%s: Truncated net frame (%d/%d bytes)", __func__, (int) (ipc_frame->datasize - PROTO_DATA_HEADROOM), rcvData->netBufLen);
+		goto drop;
+	}
+
+	__sync_add_and_fetch(&gprs_downlink_readers, 1);
+
+	gprs_connection = gprs_downlink_lookup(rcvData->contextId);
+	if(gprs_connection == NULL || gprs_downlink_queue(gprs_connection, ipc_frame->data, rcvData->netBuf, rcvData->netBufLen) < 0) {
+		__sync_sub_and_fetch(&gprs_downlink_readers, 1);
+		ALOGV("%s: Dropping net frame for contextId %d", __func__, rcvData->contextId);
+		goto drop;
+	}
+
+	__sync_sub_and_fetch(&gprs_downlink_readers, 1);
+
+	return 0;
+
+drop:
+	ipc_slab_free(ipc_frame->data);
+	return 0;
+}
+
+void *gprs_downlink_thread(void *data)
+{
+	ril_gprs_connection *gprs_connection = (ril_gprs_connection *)data;
+	struct ril_gprs_downlink *downlink = &gprs_connection->downlink;
+	struct ril_gprs_downlink_frame *entry;
+	uint64_t event;
+	int n;
+
+	while(1)
+	{
+		if(read(downlink->event_fd, &event, sizeof(event)) < 0 && errno == EINTR)
+			continue;
+
+		while(downlink->tail != __sync_add_and_fetch(&downlink->head, 0)) {
+			entry = &downlink->ring[downlink->tail % GPRS_DOWNLINK_RING];
+
+			if(!downlink->stop) {
+				n = write(gprs_connection->iface, entry->payload, entry->length);
+				ALOGV("%s: Wrote %d/%d bytes of the net frame into %s", __func__, n, entry->length, gprs_connection->ifname);
+				if(n == (int) entry->length)
+					gprs_stats_account(&gprs_connection->stats, GPRS_STATS_DOWNLINK, n, gprs_time_us());
+				else
+					gprs_connection->stats.errors[GPRS_STATS_DOWNLINK]++;
+			} else {
+				gprs_connection->stats.dropped[GPRS_STATS_DOWNLINK]++;
+			}
+
+			ipc_slab_free(entry->frame);
+
+			__sync_synchronize();
+			downlink->tail++;
+		}
+
+		if(downlink->stop)
+			break;
+	}
+
+	return NULL;
+}
+
+int gprs_start_downlink(struct ril_gprs_connection *gprs_connection)
+{
+	struct ril_gprs_downlink *downlink = &gprs_connection->downlink;
+	uint64_t event = 1;
+
+	downlink->event_fd = eventfd(0, 0);
+	if(downlink->event_fd < 0)
+		return -1;
+
+	downlink->stop = 0;
+	downlink->head = downlink->tail = 0;
+
+	if(pthread_create(&downlink->thread, NULL, gprs_downlink_thread, (void *) gprs_connection) != 0)
+		goto error;
+
+	if(gprs_downlink_publish(gprs_connection) < 0) {
+		ALOGE("%s: No free downlink slot for contextId %d", __func__, gprs_connection->contextId);
+		downlink->stop = 1;
+		write(downlink->event_fd, &event, sizeof(event));
+		pthread_join(downlink->thread, NULL);
+		goto error;
+	}
+
+	return 0;
+
+error:
+	close(downlink->event_fd);
+	downlink->event_fd = -1;
+	return -1;
+}
+
+void gprs_stop_downlink(struct ril_gprs_connection *gprs_connection)
+{
+	struct ril_gprs_downlink *downlink = &gprs_connection->downlink;
+	uint64_t event = 1;
+
+	if(downlink->event_fd < 0)
+		return;
+
+	gprs_downlink_unpublish(gprs_connection);
+
+	downlink->stop = 1;
+	write(downlink->event_fd, &event, sizeof(event));
+	pthread_join(downlink->thread, NULL);
+
+	if(gprs_connection->stats.dropped[GPRS_STATS_DOWNLINK] > 0)
+		ALOGD("%s: %u net frames dropped on %s", __func__, gprs_connection->stats.dropped[GPRS_STATS_DOWNLINK], gprs_connection->ifname);
+
+	close(downlink->event_fd);
+	downlink->event_fd = -1;
+}
+
+/*
+ * Sets the tun device up in one netlink batch and publishes the DNS servers
+ * the way libnetutils did
+ */
+static int gprs_configure(struct ril_gprs_connection *gprs_connection)
+{
+	char key[PROPERTY_KEY_MAX];
+	uint64_t start, now;
+
+	start = gprs_time_us();
+
+	if(netlink_configure(gprs_connection->ifname, gprs_connection->ip.s_addr, gprs_connection->prefix_len,
+		gprs_connection->gateway.s_addr, GPRS_MTU) < 0)
+		return -1;
+
+	snprintf(key, sizeof(key), "net.%s.dns1", gprs_connection->ifname);
+	property_set(key, inet_ntoa(gprs_connection->dns1));
+	snprintf(key, sizeof(key), "net.%s.dns2", gprs_connection->ifname);
+	property_set(key, inet_ntoa(gprs_connection->dns2));
+
+	now = gprs_time_us();
+	ALOGD("%s: %s usable %llu us after start network (configuration %llu us)", __func__, gprs_connection->ifname,
+		(unsigned long long) (now - gprs_connection->start_time), (unsigned long long) (now - start));
+
+	return 0;
+}
+
+static void gprs_deconfigure(struct ril_gprs_connection *gprs_connection)
+{
+	if(gprs_connection->ifname == NULL || gprs_connection->ip.s_addr == 0)
+		return;
+
+	netlink_deconfigure(gprs_connection->ifname, gprs_connection->ip.s_addr, gprs_connection->prefix_len);
+	gprs_connection->ip.s_addr = 0;
+}
+
+/*
+ * The tun devices are created once, made persistent and leased to the
+ * connection of the matching cid, so that setting up a data call only has
+ * to configure the device. They are reset, not destroyed, on deactivation.
+ */
+static int gprs_tun_open(int index)
+{
+	char ifname[IFNAMSIZ];
+	int fd;
+
+	snprintf(ifname, sizeof(ifname), "tun%d", index);
+	fd = tun_alloc(ifname, IFF_TUN | IFF_NO_PI);
+	if(fd < 0) {
+		ALOGE("%s: Couldn't create interface %s, errno: %d", __func__, ifname, errno);
+		return -1;
+	}
+
+	if(ioctl(fd, TUNSETPERSIST, 1) < 0)
+		ALOGE("%s: Couldn't make %s persistent, errno: %d", __func__, ifname, errno);
+
+	ril_data.tun_pool[index] = fd;
+
+	return fd;
+}
+
+void gprs_tun_pool_init(void)
+{
+	int i;
+
+	for(i = 0; i < MAX_CONNECTIONS; i++) {
+		if(ril_data.tun_pool[i] < 0)
+			gprs_tun_open(i);
+	}
+}
+
+static int gprs_tun_lease(int index)
+{
+	if(index < 0 || index >= MAX_CONNECTIONS)
+		return -1;
+
+	if(ril_data.tun_pool[index] >= 0)
+		return ril_data.tun_pool[index];
+
+	return gprs_tun_open(index);
+}
+
+static void gprs_tun_reset(int fd)
+{
+	uint8_t buffer[GPRS_MTU];
+	int flags;
+
+	/* Drop whatever the kernel still holds for the previous context */
+	flags = fcntl(fd, F_GETFL);
+	if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return;
+
+	while(read(fd, buffer, sizeof(buffer)) > 0);
+}
+
+int ril_gprs_connection_register(int cid)
+{
+	struct ril_gprs_connection *gprs_connection;
+
+	gprs_connection = calloc(1, sizeof(struct ril_gprs_connection));
+	if (gprs_connection == NULL)
+		return -1;
+
+	gprs_connection->cid = cid;
+	gprs_connection->iface = -1;
+	gprs_connection->event_fd = -1;
+	gprs_connection->downlink.event_fd = -1;
+
+	list_add_tail(&gprs_connection->list, &ril_data.gprs_connections);
+
+	return 0;
+}
+
+void ril_gprs_connection_unregister(struct ril_gprs_connection *gprs_connection)
+{
+	if (gprs_connection == NULL)
+		return;
+
+	list_del(&gprs_connection->list);
+
+	gprs_stop_downlink(gprs_connection);
+	gprs_stop_tunneling_thread(gprs_connection);
+	memset(gprs_connection, 0, sizeof(struct ril_gprs_connection));
+	free(gprs_connection);
+}
+
+struct ril_gprs_connection *ril_gprs_connection_find_cid(int cid)
+{
+	struct ril_gprs_connection *gprs_connection;
+
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list) {
+		if (gprs_connection->cid == cid)
+			return gprs_connection;
+	}
+
+	return NULL;
+}
+
+struct ril_gprs_connection *ril_gprs_connection_find_contextId(uint32_t contextId)
+{
+	struct ril_gprs_connection *gprs_connection;
+
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list) {
+		if (gprs_connection->contextId == contextId)
+			return gprs_connection;
+	}
+
+	return NULL;
+}
+
+struct ril_gprs_connection *ril_gprs_connection_start(void)
+{
+	struct ril_gprs_connection *gprs_connection;
+	int cid;
+	int rc;
+	int i;
+
+	for (i = 0 ; i < MAX_CONNECTIONS ; i++) {
+		cid = i + 1;
+		if (ril_gprs_connection_find_cid(cid) == NULL)
+			break;
+		cid = 0;
+	}
+
+	if (cid <= 0) {
+		ALOGE("Unable to find an unused cid, aborting");
+		return NULL;
+	}
+
+	ALOGD("Using GPRS connection cid: %d", cid);
+	rc = ril_gprs_connection_register(cid);
+	if (rc < 0)
+		return NULL;
+
+	gprs_connection = ril_gprs_connection_find_cid(cid);
+	asprintf(&gprs_connection->ifname, "tun%d", cid - 1);
+	gprs_connection->iface = gprs_tun_lease(cid - 1);
+	if(gprs_connection->iface < 0)
+	{
+		ALOGE("Couldn't lease interface %s", gprs_connection->ifname);
+		if (gprs_connection->ifname != NULL)
+			free(gprs_connection->ifname);
+		ril_gprs_connection_unregister(gprs_connection);
+		return NULL;
+	}
+	
+	return gprs_connection;
+}
+
+void ril_gprs_connection_stop(struct ril_gprs_connection *gprs_connection)
+{
+	ALOGD("Destroying GPRS connection with cid: %d", gprs_connection->cid);
+	if (gprs_connection == NULL)
+		return;
+
+	/* The threads have to be gone before the tun fd is closed */
+	gprs_stop_downlink(gprs_connection);
+	gprs_stop_tunneling_thread(gprs_connection);
+	gprs_deconfigure(gprs_connection);
+
+	/* The tun device goes back to the pool */
+	if (gprs_connection->iface >= 0)
+		gprs_tun_reset(gprs_connection->iface);
+	if (gprs_connection->ifname != NULL)
+		free(gprs_connection->ifname);
+
+	ril_gprs_connection_unregister(gprs_connection);
+}
+
+/*
+ * Data stall detection: every stallCheckMs each established connection is
+ * checked for uplink traffic that got no downlink traffic back, or for uplink
+ * errors. Every check that still sees the stall escalates the recovery by one
+ * step, a check that sees downlink traffic again resets it.
+ */
+
+static int gprs_stall_timer;
+
+static void gprs_stall_check(void *data);
+
+static void gprs_stall_arm(void)
+{
+	struct timeval tv;
+
+	if (gprs_stall_timer || ril_data.config.stallCheckMs == 0)
+		return;
+
+	tv.tv_sec = ril_data.config.stallCheckMs / 1000;
+	tv.tv_usec = (ril_data.config.stallCheckMs % 1000) * 1000;
+
+	gprs_stall_timer = 1;
+	ril_request_timed_callback(gprs_stall_check, NULL, &tv);
+}
+
+static void gprs_stall_reset(struct ril_gprs_connection *gprs_connection)
+{
+	gprs_connection->stall.tx_packets = gprs_connection->stats.packets[GPRS_STATS_UPLINK];
+	gprs_connection->stall.rx_packets = gprs_connection->stats.packets[GPRS_STATS_DOWNLINK];
+	gprs_connection->stall.tx_errors = gprs_connection->stats.errors[GPRS_STATS_UPLINK];
+}
+
+static void gprs_stall_check_connection(struct ril_gprs_connection *gprs_connection)
+{
+	struct ril_gprs_stall *stall = &gprs_connection->stall;
+	uint32_t tx, rx, errors;
+	int stalled = 0;
+
+	if (gprs_connection->active != 2 || gprs_connection->thread_state != 1 || stall->restarting)
+		return;
+
+	tx = gprs_connection->stats.packets[GPRS_STATS_UPLINK] - stall->tx_packets;
+	rx = gprs_connection->stats.packets[GPRS_STATS_DOWNLINK] - stall->rx_packets;
+	errors = gprs_connection->stats.errors[GPRS_STATS_UPLINK] - stall->tx_errors;
+	gprs_stall_reset(gprs_connection);
+
+	if (ril_data.config.stallUplinkPackets > 0 && rx == 0 && tx >= ril_data.config.stallUplinkPackets)
+		stalled = 1;
+	if (ril_data.config.stallErrors > 0 && errors >= ril_data.config.stallErrors)
+		stalled = 1;
+
+	if (!stalled) {
+		if (rx > 0 && stall->step != GPRS_STALL_NONE) {
+			ALOGD("%s: Data flows again on %s", __func__, gprs_connection->ifname);
+			stall->step = GPRS_STALL_NONE;
+		}
+		return;
+	}
+
+	/* The framework was told, leave it to tear the call down */
+	if (stall->step == GPRS_STALL_REPORT)
+		return;
+
+	stall->step++;
+	ALOGE("%s: Data stall on %s: %u packets sent, %u received, %u errors, recovery step %d",
+		__func__, gprs_connection->ifname, tx, rx, errors, stall->step);
+
+	switch (stall->step) {
+		case GPRS_STALL_PROBE:
+			stall->probing = 1;
+			stall->probe_contextId = gprs_connection->contextId;
+			stall->probe_time = gprs_time_us();
+			proto_start_network(&gprs_connection->start_network);
+			break;
+		case GPRS_STALL_RESTART:
+			/* An unanswered probe must not take the restart's CNF */
+			stall->probing = 0;
+			stall->restarting = 1;
+			proto_stop_context(gprs_connection->type, gprs_connection->contextId);
+			break;
+		case GPRS_STALL_REPORT:
+			gprs_connection->active = 0;
+			ril_unsol_data_call_list_changed(0);
+			break;
+	}
+}
+
+/*
+ * Finds the probe a START_NETWORK CNF answers: the one on the same context,
+ * or else the oldest probe if it was sent before the pending setup, as the
+ * CP answers in order but may give a probe a context of its own
+ */
+static struct ril_gprs_connection *gprs_stall_probe_find(uint32_t contextId, struct ril_gprs_connection *pending)
+{
+	struct ril_gprs_connection *gprs_connection;
+	struct ril_gprs_connection *oldest = NULL;
+
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list) {
+		if (!gprs_connection->stall.probing)
+			continue;
+
+		if (gprs_connection->stall.probe_contextId == contextId)
+			return gprs_connection;
+
+		if (oldest == NULL || gprs_connection->stall.probe_time < oldest->stall.probe_time)
+			oldest = gprs_connection;
+	}
+
+	if (oldest != NULL && (pending == NULL || oldest->stall.probe_time < pending->start_time))
+		return oldest;
+
+	return NULL;
 }
 
-int ril_gprs_connection_register(int cid)
+static void gprs_stall_check(void *data)
 {
 	struct ril_gprs_connection *gprs_connection;
-	struct list_head *list_end;
-	struct list_head *list;
-
-	gprs_connection = calloc(1, sizeof(struct ril_gprs_connection));
-	if (gprs_connection == NULL)
-		return -1;
 
-	gprs_connection->cid = cid;
-	gprs_connection->iface = -1;
-	pthread_mutex_init(&gprs_connection->mutex, NULL);
+	RIL_LOCK();
 
-	list_end = ril_data.gprs_connections;
-	while (list_end != NULL && list_end->next != NULL)
-		list_end = list_end->next;
+	gprs_stall_timer = 0;
 
-	list = list_head_alloc((void *) gprs_connection, list_end, NULL);
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list)
+		gprs_stall_check_connection(gprs_connection);
 
-	if (ril_data.gprs_connections == NULL)
-		ril_data.gprs_connections = list;
+	if (!list_empty(&ril_data.gprs_connections))
+		gprs_stall_arm();
 
-	return 0;
+	RIL_UNLOCK();
 }
 
-void ril_gprs_connection_unregister(struct ril_gprs_connection *gprs_connection)
+/*
+ * Fast dormancy: once a connection saw no traffic for dormancyIdleMs while
+ * the screen is off, the CP is asked to release the RRC connection instead
+ * of waiting for the network inactivity timer. When traffic comes back
+ * within dormancyIdleMs of a release, the next release waits longer.
+ */
+
+static int gprs_dormancy_timer;
+
+static void gprs_dormancy_check(void *data);
+
+static void gprs_dormancy_arm(void)
 {
-	struct list_head *list;
+	struct timeval tv;
 
-	if (gprs_connection == NULL)
+	if (gprs_dormancy_timer || ril_data.config.dormancyIdleMs == 0)
 		return;
 
-	gprs_stop_tunneling_thread(gprs_connection);
-	pthread_mutex_destroy(&gprs_connection->mutex);
-	memset(gprs_connection, 0, sizeof(struct ril_gprs_connection));
-	free(gprs_connection);
-	
-	list = ril_data.gprs_connections;
-	while (list != NULL) {
-		if (list->data == (void *) gprs_connection) {
-			if (list == ril_data.gprs_connections)
-				ril_data.gprs_connections = list->next;
-			list_head_free(list);
-			break;
-		}
-list_continue:
-		list = list->next;
-	}
+	tv.tv_sec = GPRS_DORMANCY_TICK / 1000;
+	tv.tv_usec = (GPRS_DORMANCY_TICK % 1000) * 1000;
+
+	gprs_dormancy_timer = 1;
+	ril_request_timed_callback(gprs_dormancy_check, NULL, &tv);
 }
 
-struct ril_gprs_connection *ril_gprs_connection_find_cid(int cid)
+static void gprs_dormancy_check_connection(struct ril_gprs_connection *gprs_connection, uint64_t now)
 {
-	struct ril_gprs_connection *gprs_connection;
-	struct list_head *list;
+	struct ril_gprs_dormancy *dormancy = &gprs_connection->dormancy;
+	protoRrcConnection rrc_connection;
+	uint32_t packets;
 
-	list = ril_data.gprs_connections;
-	while (list != NULL) {
-		gprs_connection = (struct ril_gprs_connection *) list->data;
-		if (gprs_connection == NULL)
-			goto list_continue;
-		if (gprs_connection->cid == cid)
-			return gprs_connection;
-list_continue:
-		list = list->next;
-	}
+	if (gprs_connection->active != 2)
+		return;
 
-	return NULL;
-}
+	packets = gprs_connection->stats.packets[GPRS_STATS_UPLINK] + gprs_connection->stats.packets[GPRS_STATS_DOWNLINK];
+	if (packets != dormancy->packets || dormancy->idle_since == 0) {
+		dormancy->packets = packets;
+		dormancy->idle_since = now;
+
+		if (dormancy->released) {
+			if (now - dormancy->released_at < (uint64_t) ril_data.config.dormancyIdleMs * 1000) {
+				dormancy->backoff = dormancy->backoff > 0 ? dormancy->backoff * 2 : ril_data.config.dormancyIdleMs;
+				if (dormancy->backoff > GPRS_DORMANCY_BACKOFF_MAX)
+					dormancy->backoff = GPRS_DORMANCY_BACKOFF_MAX;
+				dormancy->backoffs++;
+				ALOGD("%s: Traffic resumed right after releasing %s, backing off to %u ms", __func__,
+					gprs_connection->ifname, ril_data.config.dormancyIdleMs + dormancy->backoff);
+			} else {
+				dormancy->backoff = 0;
+			}
+			dormancy->released = 0;
+		}
+		return;
+	}
 
-struct ril_gprs_connection *ril_gprs_connection_find_contextId(uint32_t contextId)
-{
-	struct ril_gprs_connection *gprs_connection;
-	struct list_head *list;
+	if (dormancy->released || !ril_data.state.screen_off || gprs_call_active())
+		return;
 
-	list = ril_data.gprs_connections;
-	while (list != NULL) {
-		gprs_connection = (struct ril_gprs_connection *) list->data;
-		if (gprs_connection == NULL)
-			goto list_continue;
+	if (now - dormancy->idle_since < (uint64_t) (ril_data.config.dormancyIdleMs + dormancy->backoff) * 1000)
+		return;
 
-		if (gprs_connection->contextId == contextId)
-			return gprs_connection;
+	ALOGD("%s: %s idle for %llu ms, releasing the RRC connection", __func__, gprs_connection->ifname,
+		(unsigned long long) ((now - dormancy->idle_since) / 1000));
 
-list_continue:
-		list = list->next;
-	}
+	rrc_connection.opMode = PROTO_OPMODE_PS;
+	rrc_connection.protoType = gprs_connection->type;
+	rrc_connection.contextId = gprs_connection->contextId;
+	proto_stop_rrc_connection(&rrc_connection);
 
-	return NULL;
+	dormancy->released = 1;
+	dormancy->released_at = now;
+	dormancy->requests++;
 }
 
-struct ril_gprs_connection *ril_gprs_connection_start(void)
+static void gprs_dormancy_check(void *data)
 {
 	struct ril_gprs_connection *gprs_connection;
-	struct list_head *list;
-	int cid;
-	int rc;
-	int i;
+	uint64_t now;
 
-	for (i = 0 ; i < MAX_CONNECTIONS ; i++) {
-		cid = i + 1;
-		list = ril_data.gprs_connections;
-		while (list != NULL) {
-			if (list->data == NULL)
-				goto list_continue;
-			gprs_connection = (struct ril_gprs_connection *) list->data;
-			if (gprs_connection->cid == cid) {
-				cid = 0;
-				break;
-			}
-list_continue:
-			list = list->next;
-		}
-		if (cid > 0)
-			break;
-	}
+	RIL_LOCK();
 
-	if (cid <= 0) {
-		ALOGE("Unable to find an unused cid, aborting");
-		return NULL;
-	}
+	gprs_dormancy_timer = 0;
+	now = gprs_time_us();
 
-	ALOGD("Using GPRS connection cid: %d", cid);
-	rc = ril_gprs_connection_register(cid);
-	if (rc < 0)
-		return NULL;
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list)
+		gprs_dormancy_check_connection(gprs_connection, now);
 
-	gprs_connection = ril_gprs_connection_find_cid(cid);
-	asprintf(&gprs_connection->ifname, "tun%d", cid - 1);
-	gprs_connection->iface = tun_alloc(gprs_connection->ifname, IFF_TUN | IFF_NO_PI);
-	if(gprs_connection->iface < 0)
-	{
-		ALOGE("Couldn't create interface %s, errno: %d", gprs_connection->ifname, errno);
-		if (gprs_connection->ifname != NULL)
-			free(gprs_connection->ifname);
-		ril_gprs_connection_unregister(gprs_connection);
-		return NULL;
-	}
-	
-	return gprs_connection;
+	if (!list_empty(&ril_data.gprs_connections))
+		gprs_dormancy_arm();
+
+	RIL_UNLOCK();
 }
 
-void ril_gprs_connection_stop(struct ril_gprs_connection *gprs_connection)
+/*
+ * Fails a pending setup, or reports the call lost when it was being
+ * restarted by the stall recovery and nobody waits for it
+ */
+static void gprs_start_network_failed(struct ril_gprs_connection *gprs_connection, int restart)
 {
-	ALOGD("Destroying GPRS connection with cid: %d", gprs_connection->cid);
-	if (gprs_connection == NULL)
+	if (restart) {
+		gprs_connection->active = 0;
+		ril_unsol_data_call_list_changed(0);
 		return;
+	}
 
-	if (gprs_connection->iface >= 0)
-		close(gprs_connection->iface);
-	if (gprs_connection->ifname != NULL)
-		free(gprs_connection->ifname);
-
-	ril_gprs_connection_unregister(gprs_connection);
+	gprs_connection->fail_cause = PDP_FAIL_ERROR_UNSPECIFIED;
+	ril_data.state.gprs_last_failed_cid = gprs_connection->cid;
+	ril_request_complete(gprs_connection->token, RIL_E_GENERIC_FAILURE, NULL, 0);
+	gprs_connection->token = RIL_TOKEN_NULL;
 }
 
 void ipc_proto_starting_network_ind(void* data)
@@ -317,28 +1258,84 @@ void ipc_proto_starting_network_ind(void* data)
 
 #define IN_ADDR_FMT(ip) ((uint8_t*)&ip.s_addr)[0], ((uint8_t*)&ip.s_addr)[1], ((uint8_t*)&ip.s_addr)[2], ((uint8_t*)&ip.s_addr)[3] 
 
+static void gprs_setup_data_call_complete(struct ril_gprs_connection *gprs_connection, RIL_Token t)
+{
+	RIL_Data_Call_Response_v6 *setup_data_call_response;
+
+	setup_data_call_response = calloc(1, sizeof(RIL_Data_Call_Response_v6));
+	asprintf(&setup_data_call_response->addresses, "%d.%d.%d.%d/%d",
+		IN_ADDR_FMT(gprs_connection->ip),
+		gprs_connection->prefix_len);
+	asprintf(&setup_data_call_response->dnses, "%d.%d.%d.%d %d.%d.%d.%d",
+		IN_ADDR_FMT(gprs_connection->dns1), IN_ADDR_FMT(gprs_connection->dns2));
+	asprintf(&setup_data_call_response->gateways, "%d.%d.%d.%d",
+		IN_ADDR_FMT(gprs_connection->gateway));
+	/*asprintf(&setup_data_call_response->gateways, "%d.%d.%d.%d", 
+		((netCnf->netInfo.gatewayIp >> 24) & 0xFF), ((netCnf->netInfo.gatewayIp >> 16) & 0xFF), 
+		((netCnf->netInfo.gatewayIp >> 8) & 0xFF), ((netCnf->netInfo.gatewayIp >> 0) & 0xFF));	
+	*/
+
+	setup_data_call_response->status = PDP_FAIL_NONE;
+	setup_data_call_response->cid = gprs_connection->cid;
+	setup_data_call_response->ifname = gprs_connection->ifname;
+	setup_data_call_response->active = gprs_connection->active;
+	setup_data_call_response->type = proto_type_to_data_call_type(gprs_connection->type);
+	
+	ALOGD("GPRS configuration: cid: %d, type: %s, iface: %s, ip: %s, gateway: %s, dnses: %s", 
+		setup_data_call_response->cid, setup_data_call_response->type, 
+		setup_data_call_response->ifname, setup_data_call_response->addresses, 
+		setup_data_call_response->gateways, setup_data_call_response->dnses);
+
+	ril_request_complete(t, RIL_E_SUCCESS, setup_data_call_response, sizeof(RIL_Data_Call_Response_v6));
+	
+	if(setup_data_call_response->addresses)
+		free(setup_data_call_response->addresses);
+	if(setup_data_call_response->dnses)
+		free(setup_data_call_response->dnses);
+	if(setup_data_call_response->gateways)
+		free(setup_data_call_response->gateways);
+	free(setup_data_call_response);
+}
+
 void ipc_proto_start_network_cnf(void* data)
 {
 	struct ril_gprs_connection *gprs_connection;
+	struct ril_gprs_connection *pending;
 	protoStartNetworkCnf* netCnf = (protoStartNetworkCnf*)(data);
-	RIL_Data_Call_Response_v6 *setup_data_call_response;
-
-	gprs_connection = ril_gprs_connection_find_contextId(0xFFFFFFFF);
+	int restart;
+
+	pending = ril_gprs_connection_find_contextId(0xFFFFFFFF);
+
+	/* Answer to a stall probe, never to be taken by a pending setup */
+	gprs_connection = gprs_stall_probe_find(netCnf->contextId, pending);
+	if (gprs_connection != NULL) {
+		gprs_connection->stall.probing = 0;
+		ALOGD("%s: Stall probe on %s answered, error: %d", __func__, gprs_connection->ifname, netCnf->error);
+		gprs_connection = NULL;
+	} else {
+		gprs_connection = pending;
+	}
 
 	if (!gprs_connection) {
-		ALOGE("%s: Unable to find GPRS connection, aborting", __func__);
+		/* Nobody uses a context the CP set up on its own, don't leak it */
+		if (netCnf->error == 0 && ril_gprs_connection_find_contextId(netCnf->contextId) == NULL) {
+			ALOGE("%s: Stopping unexpected context %d", __func__, netCnf->contextId);
+			proto_stop_context(netCnf->protoType, netCnf->contextId);
+		} else if (netCnf->error != 0) {
+			ALOGE("%s: Unable to find GPRS connection, aborting", __func__);
+		}
 		return;
 	}
 	gprs_connection->contextId = netCnf->contextId;
 
+	restart = gprs_connection->stall.restarting;
+	gprs_connection->stall.restarting = 0;
+
 	if (netCnf->error != 0)
 	{
 		//FIXME: add conversion for error
 		ALOGE("%s: There was an error, aborting port list complete", __func__);
-		gprs_connection->fail_cause = PDP_FAIL_ERROR_UNSPECIFIED;
-		ril_data.state.gprs_last_failed_cid = gprs_connection->cid;
-		ril_request_complete(gprs_connection->token, RIL_E_GENERIC_FAILURE, NULL, 0);
-		gprs_connection->token = RIL_TOKEN_NULL;
+		gprs_start_network_failed(gprs_connection, restart);
 		proto_stop_context(gprs_connection->type, gprs_connection->contextId);
 		return;
 	}
@@ -350,64 +1347,35 @@ void ipc_proto_start_network_cnf(void* data)
 	// FIXME: subnet isn't reliable!
 	gprs_connection->prefix_len = 32;
 
-	if(gprs_start_tunneling_thread(gprs_connection) != 0)
+	if(gprs_start_tunneling_thread(gprs_connection) != 0 || gprs_start_downlink(gprs_connection) != 0)
 	{
-		ALOGE("%s: Couldn't start the tunneling thread", __func__);
-		gprs_connection->fail_cause = PDP_FAIL_ERROR_UNSPECIFIED;
-		ril_data.state.gprs_last_failed_cid = gprs_connection->cid;
-		ril_request_complete(gprs_connection->token, RIL_E_GENERIC_FAILURE, NULL, 0);
-		gprs_connection->token = RIL_TOKEN_NULL;
+		ALOGE("%s: Couldn't start the tunneling threads", __func__);
+		gprs_start_network_failed(gprs_connection, restart);
 		proto_stop_context(gprs_connection->type, gprs_connection->contextId);
 		return;
 	}
 
-	if(ifc_configure(gprs_connection->ifname, gprs_connection->ip.s_addr,
-		gprs_connection->prefix_len, gprs_connection->gateway.s_addr, 
-		gprs_connection->dns1.s_addr, gprs_connection->dns2.s_addr) < 0)
+	if(gprs_configure(gprs_connection) < 0)
 	{
-		ALOGE("%s: Couldn't ifc_configure on %s, errno: %d (check system logcat)", __func__, gprs_connection->ifname, errno);
-		gprs_connection->fail_cause = PDP_FAIL_ERROR_UNSPECIFIED;
-		ril_data.state.gprs_last_failed_cid = gprs_connection->cid;
-		ril_request_complete(gprs_connection->token, RIL_E_GENERIC_FAILURE, NULL, 0);
-		gprs_connection->token = RIL_TOKEN_NULL;
+		ALOGE("%s: Couldn't configure %s", __func__, gprs_connection->ifname);
+		gprs_start_network_failed(gprs_connection, restart);
 		proto_stop_context(gprs_connection->type, gprs_connection->contextId);
 		return;
 	}
-	
-	setup_data_call_response = calloc(1, sizeof(RIL_Data_Call_Response_v6));
-	asprintf(&setup_data_call_response->addresses, "%d.%d.%d.%d/%d",
-		IN_ADDR_FMT(gprs_connection->ip),
-		gprs_connection->prefix_len);
-	asprintf(&setup_data_call_response->dnses, "%d.%d.%d.%d %d.%d.%d.%d",
-		IN_ADDR_FMT(gprs_connection->dns1), IN_ADDR_FMT(gprs_connection->dns2));
-	asprintf(&setup_data_call_response->gateways, "%d.%d.%d.%d",
-		IN_ADDR_FMT(gprs_connection->gateway));
-	/*asprintf(&setup_data_call_response->gateways, "%d.%d.%d.%d", 
-		((netCnf->netInfo.gatewayIp >> 24) & 0xFF), ((netCnf->netInfo.gatewayIp >> 16) & 0xFF), 
-		((netCnf->netInfo.gatewayIp >> 8) & 0xFF), ((netCnf->netInfo.gatewayIp >> 0) & 0xFF));	
-	*/
 
-	setup_data_call_response->status = PDP_FAIL_NONE;
-	setup_data_call_response->cid = gprs_connection->cid;
-	setup_data_call_response->ifname = gprs_connection->ifname;
-	setup_data_call_response->active = gprs_connection->active;
-	setup_data_call_response->type = proto_type_to_data_call_type(gprs_connection->type);
-	
-	ALOGD("GPRS configuration: cid: %d, type: %s, iface: %s, ip: %s, gateway: %s, dnses: %s", 
-		setup_data_call_response->cid, setup_data_call_response->type, 
-		setup_data_call_response->ifname, setup_data_call_response->addresses, 
-		setup_data_call_response->gateways, setup_data_call_response->dnses);
+	gprs_stall_reset(gprs_connection);
+	gprs_stall_arm();
+	gprs_dormancy_arm();
 
-	ril_request_complete(gprs_connection->token, RIL_E_SUCCESS, setup_data_call_response, sizeof(RIL_Data_Call_Response_v6));
-	gprs_connection->token = RIL_TOKEN_NULL;
+	if (restart) {
+		ALOGD("%s: Restarted %s, contextId %d", __func__, gprs_connection->ifname, gprs_connection->contextId);
+		ril_unsol_data_call_list_changed(0);
+		return;
+	}
 	
-	if(setup_data_call_response->addresses)
-		free(setup_data_call_response->addresses);
-	if(setup_data_call_response->dnses)
-		free(setup_data_call_response->dnses);
-	if(setup_data_call_response->gateways)
-		free(setup_data_call_response->gateways);
-	free(setup_data_call_response);
+	gprs_connection->users = 1;
+	gprs_setup_data_call_complete(gprs_connection, gprs_connection->token);
+	gprs_connection->token = RIL_TOKEN_NULL;
 }
 
 void ipc_proto_stop_network_cnf(void* data)
@@ -422,6 +1390,18 @@ void ipc_proto_stop_network_cnf(void* data)
 		return;
 	}
 
+	/* Stall recovery: bring the same connection up again on a new context */
+	if (gprs_connection->stall.restarting && gprs_connection->token == RIL_TOKEN_NULL) {
+		gprs_stop_downlink(gprs_connection);
+		gprs_stop_tunneling_thread(gprs_connection);
+		gprs_deconfigure(gprs_connection);
+		gprs_connection->active = 1;
+		gprs_connection->contextId = 0xFFFFFFFF;
+		gprs_connection->start_time = gprs_time_us();
+		proto_start_network(&gprs_connection->start_network);
+		return;
+	}
+
 	if (gprs_connection->token != RIL_TOKEN_NULL)
 		ril_request_complete(gprs_connection->token, RIL_E_SUCCESS, NULL, 0);
 
@@ -452,19 +1432,43 @@ void ipc_proto_stop_network_ind(void* data)
 	ril_unsol_data_call_list_changed(0);
 }
 
+/*
+ * Only reached by net frames that came in several FIFO frames; single frames
+ * are taken by gprs_downlink_dispatch before ipc_dispatch
+ */
 void ipc_proto_receive_data_ind(void* data)
 {
-	int n;
 	struct ril_gprs_connection *gprs_connection = NULL;
 	protoTransferDataBuf* rcvData = (protoTransferDataBuf*)data;
+	uint8_t *frame;
+
 	gprs_connection = ril_gprs_connection_find_contextId(rcvData->contextId);
-	if(!gprs_connection || gprs_connection->iface < 0)
+	if(!gprs_connection || gprs_connection->downlink.event_fd < 0)
 	{
 		ALOGE("%s: Couldn't find gprs_connection context or tun fd is invalid!", __func__);
 		return;
 	}
-	n = write(gprs_connection->iface, rcvData->netBuf, rcvData->netBufLen);
-	ALOGV("%s: Wrote %d/%d bytes of the net frame into %s", __func__, n, rcvData->netBufLen, gprs_connection->ifname);
+
+	/* The reassembled frame is released after dispatch, keep a copy */
+	frame = ipc_slab_alloc(rcvData->netBufLen);
+	if(frame == NULL)
+		return;
+
+	memcpy(frame, rcvData->netBuf, rcvData->netBufLen);
+	if(gprs_downlink_queue(gprs_connection, frame, frame, rcvData->netBufLen) < 0)
+		ipc_slab_free(frame);
+}
+
+void ipc_proto_rrc_connection_ind(void* data)
+{
+	struct ril_gprs_connection *gprs_connection;
+	uint64_t now = gprs_time_us();
+
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list) {
+		if (gprs_connection->dormancy.released)
+			ALOGD("%s: RRC connection changed %llu ms after %s was released", __func__,
+				(unsigned long long) ((now - gprs_connection->dormancy.released_at) / 1000), gprs_connection->ifname);
+	}
 }
 
 void ipc_proto_suspend_network_ind(void* data)
@@ -501,14 +1505,37 @@ void ipc_proto_resume_network_ind(void* data)
 	ril_unsol_data_call_list_changed(0);
 }
 
+/*
+ * An established context started with the same APN, credentials and type can
+ * serve another data call: it is shared and only stopped with its last user
+ */
+static struct ril_gprs_connection *gprs_connection_find_shared(protoStartNetwork *start_network)
+{
+	struct ril_gprs_connection *gprs_connection;
+
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list) {
+		if (gprs_connection->active != 2 || gprs_connection->users <= 0 ||
+			gprs_connection->token != RIL_TOKEN_NULL || gprs_connection->stall.restarting)
+			continue;
+
+		if (gprs_connection->start_network.protoType == start_network->protoType &&
+			!strncmp(gprs_connection->start_network.napAddr, start_network->napAddr, sizeof(start_network->napAddr)) &&
+			!strncmp(gprs_connection->start_network.userId, start_network->userId, sizeof(start_network->userId)) &&
+			!strncmp(gprs_connection->start_network.userPasswd, start_network->userPasswd, sizeof(start_network->userPasswd)))
+			return gprs_connection;
+	}
+
+	return NULL;
+}
+
 void ril_request_setup_data_call(RIL_Token t, void *data, int length)
 {
 	struct ril_gprs_connection *gprs_connection = NULL;
 	char *username = NULL;
 	char *password = NULL;
 	char *apn = NULL;
-	protoStartNetwork* start_network;
-
+	protoStartNetwork start_network;
+	uint8_t type;
 
 	if (data == NULL || length < (int) (4 * sizeof(char *)))
 		goto error;
@@ -519,30 +1546,17 @@ void ril_request_setup_data_call(RIL_Token t, void *data, int length)
 
 	ALOGD("%s: Requesting data connection to APN '%s'\n", __func__, apn);
 
-	gprs_connection = ril_gprs_connection_start();
-
-	if (!gprs_connection) {
-		ALOGE("%s: Unable to create GPRS connection, aborting", __func__);
-		ril_request_complete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-		return;
-	}
-
-	gprs_connection->type = data_call_type_to_proto_type(((char **) data)[6]);
-	if(gprs_connection->type == PROTO_TYPE_NONE)
+	type = data_call_type_to_proto_type(((char **) data)[6]);
+	if(type == PROTO_TYPE_NONE)
 	{
 		ALOGE("%s: Unsupported data connection type %s", __func__, ((char **) data)[6]);
-		ril_request_complete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-		gprs_connection->token = RIL_TOKEN_NULL;
-		ril_gprs_connection_stop(gprs_connection);
-		return;
+		goto error;
 	}
-	gprs_connection->token = t;
-	gprs_connection->contextId = 0xFFFFFFFF;
 
-	start_network = (protoStartNetwork *)calloc(1, sizeof(protoStartNetwork));
+	memset(&start_network, 0, sizeof(protoStartNetwork));
 
-	start_network->opMode = PROTO_OPMODE_PS;
-	start_network->protoType = gprs_connection->type;
+	start_network.opMode = PROTO_OPMODE_PS;
+	start_network.protoType = type;
 
 	unsigned int i = 0;
 
@@ -550,23 +1564,23 @@ void ril_request_setup_data_call(RIL_Token t, void *data, int length)
 	{
 		while (i < strlen(apn))
 		{
-			start_network->napAddr[i] = apn[i];
+			start_network.napAddr[i] = apn[i];
 			i = i + 1;
 		}
 	}
 
-	start_network->preferredAccountHandle = 0x21;
-	start_network->localAddr = 0xFFFFFFFF;
-	start_network->dnsAddr1 = 0xFFFFFFFF;
-	start_network->dnsAddr2 = 0xFFFFFFFF;
-//	start_network->authType = 0x01; //PAP
+	start_network.preferredAccountHandle = 0x21;
+	start_network.localAddr = 0xFFFFFFFF;
+	start_network.dnsAddr1 = 0xFFFFFFFF;
+	start_network.dnsAddr2 = 0xFFFFFFFF;
+//	start_network.authType = 0x01; //PAP
 
 	if (username != NULL)
 	{
 		i = 0;
 		while (i < strlen(username))
 		{
-			start_network->userId[i] = username[i];
+			start_network.userId[i] = username[i];
 			i = i + 1;
 		}
 	}
@@ -576,12 +1590,37 @@ void ril_request_setup_data_call(RIL_Token t, void *data, int length)
 		i = 0;
 		while (i < strlen(password))
 		{
-			start_network->userPasswd[i] = password[i];
+			start_network.userPasswd[i] = password[i];
 			i = i + 1;
 		}
 	}
 
-	proto_start_network(start_network);
+	gprs_connection = gprs_connection_find_shared(&start_network);
+	if (gprs_connection != NULL) {
+		gprs_connection->users++;
+		ALOGD("%s: Sharing cid %d on %s, %d users", __func__, gprs_connection->cid,
+			gprs_connection->ifname, gprs_connection->users);
+		gprs_setup_data_call_complete(gprs_connection, t);
+		return;
+	}
+
+	gprs_connection = ril_gprs_connection_start();
+
+	if (!gprs_connection) {
+		ALOGE("%s: Unable to create GPRS connection, aborting", __func__);
+		ril_request_complete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+		return;
+	}
+
+	gprs_connection->type = type;
+	gprs_connection->token = t;
+	gprs_connection->contextId = 0xFFFFFFFF;
+
+	/* Kept with the connection for the stall recovery and sharing */
+	memcpy(&gprs_connection->start_network, &start_network, sizeof(protoStartNetwork));
+
+	gprs_connection->start_time = gprs_time_us();
+	proto_start_network(&gprs_connection->start_network);
 
 	return;
 error:
@@ -607,6 +1646,15 @@ void ril_request_deactivate_data_call(RIL_Token t, void *data, int length)
 		ril_request_complete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 	return;
 	}
+
+	if (gprs_connection->users > 1) {
+		gprs_connection->users--;
+		ALOGD("%s: cid %d is still used by %d data calls, keeping it", __func__,
+			gprs_connection->cid, gprs_connection->users);
+		ril_request_complete(t, RIL_E_SUCCESS, NULL, 0);
+		return;
+	}
+
 	gprs_connection->token = t;
 
 	proto_stop_context(gprs_connection->type, gprs_connection->contextId);
@@ -656,35 +1704,34 @@ fail_cause_return:
 void ril_unsol_data_call_list_changed(RIL_Token t)
 {
 	struct ril_gprs_connection *gprs_connection;
-	struct list_head *list;
 	RIL_Data_Call_Response_v6 *data_call_list = NULL;
 	int i = 0;
-	int j;
 
-	list = ril_data.gprs_connections;
-	while (list != NULL) {
-		gprs_connection = (struct ril_gprs_connection *) list->data;
-		if (gprs_connection == NULL)
-			goto list_continue;
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list)
+		i++;
+
+	if (i > 0)
+		data_call_list = ril_arena_alloc(i * sizeof(RIL_Data_Call_Response_v6));
+
+	i = 0;
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list) {
+		if (data_call_list == NULL)
+			break;
 
-		data_call_list = realloc(data_call_list, (i + 1) * sizeof(RIL_Data_Call_Response_v6));
-		memset(&(data_call_list[i]), 0, sizeof(RIL_Data_Call_Response_v6));
 		data_call_list[i].status = PDP_FAIL_NONE;
 		data_call_list[i].cid = gprs_connection->cid;
 		data_call_list[i].active = gprs_connection->active;
 		data_call_list[i].type = proto_type_to_data_call_type(gprs_connection->type);
 		data_call_list[i].ifname = gprs_connection->ifname;
-		asprintf(&data_call_list[i].addresses, "%d.%d.%d.%d/%d",
+		data_call_list[i].addresses = ril_arena_printf("%d.%d.%d.%d/%d",
 			IN_ADDR_FMT(gprs_connection->ip),
 			gprs_connection->prefix_len);
-		asprintf(&data_call_list[i].dnses, "%d.%d.%d.%d %d.%d.%d.%d",
+		data_call_list[i].dnses = ril_arena_printf("%d.%d.%d.%d %d.%d.%d.%d",
 			IN_ADDR_FMT(gprs_connection->dns1), IN_ADDR_FMT(gprs_connection->dns2));
-		asprintf(&data_call_list[i].gateways, "%d.%d.%d.%d",
+		data_call_list[i].gateways = ril_arena_printf("%d.%d.%d.%d",
 			IN_ADDR_FMT(gprs_connection->gateway));
+		gprs_stats_dump(gprs_connection);
 		i++;
-
-list_continue:
-		list = list->next;
 	}
 
 	if (t == 0)
@@ -693,18 +1740,6 @@ list_continue:
 	else
 		ril_request_complete(t, RIL_E_SUCCESS,
 			data_call_list, i * sizeof(RIL_Data_Call_Response_v6));
-
-	j = i;
-	for (i = 0; i < j; i++) {
-		if (data_call_list[i].addresses)
-			free(data_call_list[i].addresses);
-		if (data_call_list[i].dnses)
-			free(data_call_list[i].dnses);
-		if (data_call_list[i].gateways)
-			free(data_call_list[i].gateways);
-	}
-	if(data_call_list)
-		free(data_call_list);
 }
 
 void ril_request_data_call_list(RIL_Token t)
@@ -712,6 +1747,71 @@ void ril_request_data_call_list(RIL_Token t)
 	ril_unsol_data_call_list_changed(t);
 }
 
+static void gprs_stats_fill(struct ril_gprs_connection *gprs_connection, struct srs_gprs_stats_packet *packet)
+{
+	struct ril_gprs_stats *stats = &gprs_connection->stats;
+	uint64_t now = gprs_time_us();
+
+	memset(packet, 0, sizeof(struct srs_gprs_stats_packet));
+	packet->cid = gprs_connection->cid;
+	packet->contextId = gprs_connection->contextId;
+	packet->tx_packets = stats->packets[GPRS_STATS_UPLINK];
+	packet->rx_packets = stats->packets[GPRS_STATS_DOWNLINK];
+	packet->tx_bytes = stats->bytes[GPRS_STATS_UPLINK];
+	packet->rx_bytes = stats->bytes[GPRS_STATS_DOWNLINK];
+	packet->tx_dropped = stats->dropped[GPRS_STATS_UPLINK];
+	packet->rx_dropped = stats->dropped[GPRS_STATS_DOWNLINK];
+	packet->tx_errors = stats->errors[GPRS_STATS_UPLINK];
+	packet->rx_errors = stats->errors[GPRS_STATS_DOWNLINK];
+	packet->tx_rate = gprs_stats_rate(stats, GPRS_STATS_UPLINK, now);
+	packet->rx_rate = gprs_stats_rate(stats, GPRS_STATS_DOWNLINK, now);
+	memcpy(packet->tx_latency, stats->latency, sizeof(packet->tx_latency));
+}
+
+void gprs_stats_dump(struct ril_gprs_connection *gprs_connection)
+{
+	struct srs_gprs_stats_packet packet;
+
+	gprs_stats_fill(gprs_connection, &packet);
+
+	ALOGD("GPRS stats: cid: %d, iface: %s, tx: %u packets %llu bytes %u B/s, %u dropped, %u errors",
+		packet.cid, gprs_connection->ifname, packet.tx_packets, (unsigned long long) packet.tx_bytes,
+		packet.tx_rate, packet.tx_dropped, packet.tx_errors);
+	ALOGD("GPRS stats: cid: %d, iface: %s, rx: %u packets %llu bytes %u B/s, %u dropped, %u errors",
+		packet.cid, gprs_connection->ifname, packet.rx_packets, (unsigned long long) packet.rx_bytes,
+		packet.rx_rate, packet.rx_dropped, packet.rx_errors);
+	ALOGD("GPRS stats: cid: %d, tx latency (128us..): %u %u %u %u %u %u %u %u %u %u %u %u",
+		packet.cid, packet.tx_latency[0], packet.tx_latency[1], packet.tx_latency[2],
+		packet.tx_latency[3], packet.tx_latency[4], packet.tx_latency[5], packet.tx_latency[6],
+		packet.tx_latency[7], packet.tx_latency[8], packet.tx_latency[9], packet.tx_latency[10],
+		packet.tx_latency[11]);
+	ALOGD("GPRS stats: cid: %d, %u RRC releases, %u backoffs", packet.cid,
+		gprs_connection->dormancy.requests, gprs_connection->dormancy.backoffs);
+}
+
+void srs_gprs_stats(struct srs_client_info *client, struct srs_message *message)
+{
+	struct ril_gprs_connection *gprs_connection;
+	struct srs_gprs_stats_packet packets[MAX_CONNECTIONS];
+	int cid = 0;
+	int count = 0;
+
+	if (message->data != NULL && message->length >= (int) sizeof(int))
+		cid = *((int *) message->data);
+
+	list_for_each_entry(gprs_connection, &ril_data.gprs_connections, list) {
+		if (count >= MAX_CONNECTIONS)
+			break;
+		if (cid != 0 && gprs_connection->cid != cid)
+			continue;
+
+		gprs_stats_fill(gprs_connection, &packets[count]);
+		count++;
+	}
+
+	srs_send(client, SRS_GPRS_STATS, packets, count * sizeof(struct srs_gprs_stats_packet));
+}
+
 void proto_stop_context(uint8_t type, uint32_t contextId)
 {
 	protoStopNetwork stop_network;
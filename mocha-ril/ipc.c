@@ -24,6 +24,7 @@
 
 #include "mocha-ril.h"
 #include <radio.h>
+#include <slab.h>
 
 /**
  * IPC shared 
@@ -58,6 +59,67 @@ void ipc_send(struct modem_io *request)
 	RIL_CLIENT_UNLOCK(ril_data.ipc_packet_client);
 }
 
+/*
+ * Streams a frame whose data comes from fill. The client lock is held for
+ * the whole frame so that no other frame lands between its pieces, so fill
+ * should only copy out data that was read ahead of it
+ */
+int ipc_send_stream(struct modem_io *request, ipc_stream_fill_cb fill, void *fill_data)
+{
+	struct ipc_client *ipc_client;
+	int rc;
+
+	if(ril_data.ipc_packet_client == NULL) {
+		ALOGE("ipc_packet_client is null, aborting!");
+		return -1;
+	}
+
+	if(ril_data.ipc_packet_client->data == NULL) {
+		ALOGE("ipc_packet_client data is null, aborting!");
+		return -1;
+	}
+
+	ipc_client = ((struct ipc_client_data *) ril_data.ipc_packet_client->data)->ipc_client;
+
+	RIL_CLIENT_LOCK(ril_data.ipc_packet_client);
+	rc = ipc_client_send_stream(ipc_client, request, fill, fill_data);
+	RIL_CLIENT_UNLOCK(ril_data.ipc_packet_client);
+
+	return rc;
+}
+
+/*
+ * Sends several frames back to back, taking the client lock only once.
+ * Returns the number of frames the modem took
+ */
+int ipc_send_batch(struct modem_io *requests, int count)
+{
+	struct ipc_client *ipc_client;
+	int sent = 0;
+	int i;
+
+	if(ril_data.ipc_packet_client == NULL) {
+		ALOGE("ipc_packet_client is null, aborting!");
+		return 0;
+	}
+
+	if(ril_data.ipc_packet_client->data == NULL) {
+		ALOGE("ipc_packet_client data is null, aborting!");
+		return 0;
+	}
+
+	ipc_client = ((struct ipc_client_data *) ril_data.ipc_packet_client->data)->ipc_client;
+
+	RIL_CLIENT_LOCK(ril_data.ipc_packet_client);
+	for(i = 0; i < count; i++) {
+		if(ipc_client_send(ipc_client, &requests[i]) >= 0)
+			sent++;
+	}
+	RIL_CLIENT_UNLOCK(ril_data.ipc_packet_client);
+
+	return sent;
+}
+
 int ipc_modem_io(void *data, uint32_t cmd)
 {
 	int retval;
@@ -122,13 +184,17 @@ int ipc_read_loop(struct ril_client *client)
 				return -1;
 			}
 			RIL_CLIENT_UNLOCK(client);
-			
+
+			/* Downlink data goes straight to its tun device */
+			if(gprs_downlink_dispatch(&resp) == 0)
+				continue;
+
 			RIL_LOCK();
 			ipc_dispatch(ipc_client, &resp);			
 			RIL_UNLOCK();
 			
 			if(resp.data != NULL)
-				free(resp.data);
+				ipc_slab_free(resp.data);
 		}
 	}
 	ALOGI("Exiting read loop");
@@ -41,6 +41,7 @@ struct ipc_client_data {
 extern struct ril_client_funcs ipc_client_funcs;
 
 void ipc_send(struct modem_io *request);
+int ipc_send_batch(struct modem_io *requests, int count);
 
 int ipc_modem_io(void *data, uint32_t cmd);
 
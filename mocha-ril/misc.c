@@ -30,6 +30,8 @@
 void ril_request_get_imei(RIL_Token t)
 {
 	if(cached_imei[0] != 0x00) {
+		if(ril_data.provisional & RIL_SNAPSHOT_IMEI)
+			ALOGD("%s: Serving provisional IMEI from snapshot", __func__);
 		ril_request_complete(t, RIL_E_SUCCESS, cached_imei, sizeof(cached_imei));
 	} else {
 		ALOGD("%s: Not ready yet, queuing token!", __func__);
@@ -40,6 +42,8 @@ void ril_request_get_imei(RIL_Token t)
 void ril_request_baseband_version(RIL_Token t)
 {
 	if(ril_data.cached_sw_version[0] != 0x00) {
+		if(ril_data.provisional & RIL_SNAPSHOT_BASEBAND)
+			ALOGD("%s: Serving provisional baseband version from snapshot", __func__);
 		ril_request_complete(t, RIL_E_SUCCESS, ril_data.cached_sw_version, sizeof(ril_data.cached_sw_version));
 	} else {
 		ALOGD("%s: Not ready yet, queuing token!", __func__);
@@ -53,11 +57,17 @@ void ril_request_screen_state(RIL_Token t, void *data, size_t datalen)
 	uint32_t status = 0;
 
 	if (((int *)data)[0] == 0 )
+	{
+		ril_data.state.screen_off = 1;
+		gprs_uplink_hold_update();
 		ipc_power_mode(0);
+	}
 	else
 	{
 		drv_send_packet(BATT_GAUGE_STATUS_REQ, (uint8_t*)&status, 4);
 		ipc_power_mode(6);
+		ril_data.state.screen_off = 0;
+		gprs_uplink_hold_update();
 	}
 	ril_request_complete(t, RIL_E_SUCCESS, NULL, 0);
 }
@@ -74,6 +84,8 @@ void ril_request_screen_state(RIL_Token t, void *data, size_t datalen)
 void ril_request_get_imsi(RIL_Token t)
 {
 	if (ril_data.cached_imsi[0] != 0x00) {
+		if (ril_data.provisional & RIL_SNAPSHOT_IMSI)
+			ALOGD("%s: Serving provisional IMSI from snapshot", __func__);
 		ril_request_complete(t, RIL_E_SUCCESS, ril_data.cached_imsi, sizeof(ril_data.cached_imsi));
 		ril_data.tokens.get_imsi = 0;
 	} else {
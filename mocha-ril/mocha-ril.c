@@ -78,8 +78,6 @@ int ril_request_id_set(int id)
 int ril_request_register(RIL_Token t, int id)
 {
 	struct ril_request_info *request;
-	struct list_head *list_end;
-	struct list_head *list;
 
 	request = calloc(1, sizeof(struct ril_request_info));
 	if(request == NULL)
@@ -89,83 +87,40 @@ int ril_request_register(RIL_Token t, int id)
 	request->id = id;
 	request->canceled = 0;
 
-	list_end = ril_data.requests;
-	while(list_end != NULL && list_end->next != NULL)
-		list_end = list_end->next;
-
-	list = list_head_alloc((void *) request, list_end, NULL);
-
-	if(ril_data.requests == NULL)
-		ril_data.requests = list;
+	hash_map_add(&ril_data.requests_token, &request->token_node, (uintptr_t) t);
+	hash_map_add(&ril_data.requests_id, &request->id_node, (uintptr_t) id);
 
 	return 0;
 }
 
 void ril_request_unregister(struct ril_request_info *request)
 {
-	struct list_head *list;
-
 	if(request == NULL)
 		return;
 
-	list = ril_data.requests;
-	while(list != NULL) {
-		if(list->data == (void *) request) {
-			memset(request, 0, sizeof(struct ril_request_info));
-			free(request);
-
-			if(list == ril_data.requests)
-				ril_data.requests = list->next;
-
-			list_head_free(list);
+	hash_map_del(&request->token_node);
+	hash_map_del(&request->id_node);
 
-			break;
-		}
-list_continue:
-		list = list->next;
-	}
+	memset(request, 0, sizeof(struct ril_request_info));
+	free(request);
 }
 
 struct ril_request_info *ril_request_info_find_id(int id)
 {
-	struct ril_request_info *request;
-	struct list_head *list;
+	struct hash_node *node;
 
-	list = ril_data.requests;
-	while(list != NULL) {
-		request = (struct ril_request_info *) list->data;
-		if(request == NULL)
-			goto list_continue;
+	node = hash_map_find(&ril_data.requests_id, (uintptr_t) id);
 
-		if(request->id == id)
-			return request;
-
-list_continue:
-		list = list->next;
-	}
-
-	return NULL;
+	return hash_map_entry(node, struct ril_request_info, id_node);
 }
 
 struct ril_request_info *ril_request_info_find_token(RIL_Token t)
 {
-	struct ril_request_info *request;
-	struct list_head *list;
+	struct hash_node *node;
 
-	list = ril_data.requests;
-	while(list != NULL) {
-		request = (struct ril_request_info *) list->data;
-		if(request == NULL)
-			goto list_continue;
+	node = hash_map_find(&ril_data.requests_token, (uintptr_t) t);
 
-		if(request->token == t)
-			return request;
-
-list_continue:
-		list = list->next;
-	}
-
-	return NULL;
+	return hash_map_entry(node, struct ril_request_info, token_node);
 }
 
 int ril_request_set_canceled(RIL_Token t, int canceled)
@@ -225,6 +180,10 @@ void ril_request_complete(RIL_Token t, RIL_Errno e, void *data, size_t length)
 	struct ril_request_info *request;
 	int canceled = 0;
 
+	// The request was already answered by ril_on_cancel
+	if(t == RIL_TOKEN_CANCELED)
+		goto reset;
+
 	request = ril_request_info_find_token(t);
 	if(request == NULL)
 		goto complete;
@@ -233,15 +192,20 @@ void ril_request_complete(RIL_Token t, RIL_Errno e, void *data, size_t length)
 	ril_request_unregister(request);
 
 	if(canceled)
-		return;
+		goto reset;
 
 complete:
 	ril_data.env->OnRequestComplete(t, e, data, length);
+
+reset:
+	// RILD copied the response, drop whatever was built in the arena
+	ril_arena_reset();
 }
 
 void ril_request_unsolicited(int request, void *data, size_t length)
 {
 	ril_data.env->OnUnsolicitedResponse(request, data, length);
+	ril_arena_reset();
 }
 
 void ril_request_timed_callback(RIL_TimedCallback callback, void *data, const struct timeval *time)
@@ -276,6 +240,29 @@ void ril_tokens_check(void)
 	}
 }
 
+int ril_tokens_cancel(RIL_Token t)
+{
+	RIL_Token *tokens;
+	unsigned int i;
+	int rc = 0;
+
+	if (t == RIL_TOKEN_NULL || t == RIL_TOKEN_DATA_WAITING || t == RIL_TOKEN_CANCELED)
+		return 0;
+
+	// struct ril_tokens only holds RIL_Token members
+	tokens = (RIL_Token *) &ril_data.tokens;
+	for (i = 0; i < sizeof(struct ril_tokens) / sizeof(RIL_Token); i++) {
+		if (tokens[i] != t)
+			continue;
+
+		// Keep the slot busy, but its answer won't reach RILD anymore
+		tokens[i] = RIL_TOKEN_CANCELED;
+		rc = 1;
+	}
+
+	return rc;
+}
+
 void srs_dispatch(struct srs_client_info *client, struct srs_message *message)
 {
 	if(message == NULL)
@@ -311,6 +298,9 @@ void srs_dispatch(struct srs_client_info *client, struct srs_message *message)
 		case SRS_GPS_DELETE_DATA:
 			lbs_delete_gps_data();
 			break;
+		case SRS_GPRS_STATS:
+			srs_gprs_stats(client, message);
+			break;
 		default:
 			ALOGD("Unhandled command: (%04x)", message->command);
 			break;
@@ -514,7 +504,32 @@ int ril_on_supports(int request)
 
 void ril_on_cancel(RIL_Token t)
 {
-	ril_request_set_canceled(t, 1);
+	int rc;
+
+	RIL_LOCK();
+
+	/*
+	 * Work that never reached the modem (or that we could abort) is dropped
+	 * right away. Work already on the modem is moved to RIL_TOKEN_CANCELED,
+	 * so its owner swallows the late answer: RILD may reuse t once answered.
+	 */
+	rc = ril_request_query_available_networks_cancel(t);
+	if (rc < 0)
+		rc = ril_request_sim_io_cancel(t);
+	if (rc < 0)
+		rc = ril_request_send_sms_cancel(t);
+	if (rc < 0 && ril_tokens_cancel(t))
+		rc = 0;
+
+	if (rc < 0) {
+		ALOGD("%s: Nothing pending for token %p", __func__, t);
+		goto unlock;
+	}
+
+	ril_request_complete(t, RIL_E_CANCELLED, NULL, 0);
+
+unlock:
+	RIL_UNLOCK();
 }
 
 const char *ril_get_version(void)
@@ -564,6 +579,7 @@ void ril_install_ipc_callbacks(void)
 	ipc_register_ril_cb(PROTO_RECEIVE_DATA_IND, ipc_proto_receive_data_ind);
 	ipc_register_ril_cb(PROTO_SUSPEND_NETWORK_IND, ipc_proto_suspend_network_ind);
 	ipc_register_ril_cb(PROTO_RESUME_NETWORK_IND, ipc_proto_resume_network_ind);
+	ipc_register_ril_cb(PROTO_RRC_CONNECTION_IND, ipc_proto_rrc_connection_ind);
 }
  
 void ril_data_init(void)
@@ -571,6 +587,11 @@ void ril_data_init(void)
 	memset(&ril_data, 0, sizeof(ril_data));
 
 	pthread_mutex_init(&ril_data.mutex, NULL);
+	list_head_init(&ril_data.outgoing_sms);
+	list_head_init(&ril_data.gprs_connections);
+	memset(ril_data.tun_pool, -1, sizeof(ril_data.tun_pool));
+	list_head_init(&ril_data.net_select_list);
+	list_head_init(&ril_data.sim_io);
 	ril_data.state.sim_state = SIM_STATE_NOT_READY;
 	ril_data.inDevice = SND_INPUT_MAIN_MIC;
 	ril_data.outDevice = SND_OUTPUT_EARPIECE;
@@ -606,6 +627,9 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 	RIL_LOCK();
 	
 	ipc_init();
+	fm_set_durability(ril_data.config.fmDurability, ril_data.config.fmCommitDeadlineMs);
+	load_ril_snapshot();
+	gprs_tun_pool_init();
 	ril_install_ipc_callbacks();
 
 	ALOGI("Creating IPC client");
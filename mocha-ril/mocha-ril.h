@@ -30,11 +30,13 @@
 
 #include <radio.h>
 
+#include "util.h"
 #include "ipc.h"
 #include "srs.h"
 
 #include <tapi_network.h>
 #include <tapi_call.h>
+#include <proto.h>
 
 /**
  * Defines
@@ -50,6 +52,7 @@
 #define RIL_CLIENT_UNLOCK(client) pthread_mutex_unlock(&(client->mutex))
 
 #define RIL_TOKEN_DATA_WAITING	(RIL_Token) 0xff
+#define RIL_TOKEN_CANCELED	(RIL_Token) 0xfe
 #define RIL_TOKEN_NULL		(RIL_Token) 0x00
 
 /**
@@ -106,6 +109,9 @@ struct ril_request_info {
 	RIL_Token token;
 	int id;
 	int canceled;
+
+	struct hash_node token_node;
+	struct hash_node id_node;
 };
 
 int ril_request_id_get(void);
@@ -148,6 +154,7 @@ struct ril_tokens {
 };
 
 void ril_tokens_check(void);
+int ril_tokens_cancel(RIL_Token t);
 
 /**
  * RIL state
@@ -187,12 +194,53 @@ struct ril_state {
 	char SPN[NET_MAX_SPN_LEN];
 	char name[NET_MAX_NAME_LEN];
 	unsigned char dtmf_tone;
+	int screen_off;
 };
 
 typedef struct ril_config {
 	uint32_t bAutoAttach;
+	uint32_t uplinkHoldMs; /* 0 disables holding uplink data while the screen is off */
+	uint32_t uplinkHoldBytes;
+	uint32_t stallCheckMs; /* 0 disables data stall detection */
+	uint32_t stallUplinkPackets; /* sent without anything received in one check */
+	uint32_t stallErrors; /* uplink errors in one check */
+	uint32_t dormancyIdleMs; /* 0 disables releasing the RRC connection when idle */
+	uint32_t fmDurability; /* enum fm_durability */
+	uint32_t fmCommitDeadlineMs; /* for FM_DURABILITY_DEADLINE */
 } ril_config;
 
+/*
+ * Identity and registration values persisted across rild restarts, served
+ * as provisional until the modem reports them again
+ */
+
+#define RIL_SNAPSHOT_MAGIC	0x50534E53 /* SNSP */
+#define RIL_SNAPSHOT_VERSION	1
+
+enum ril_snapshot_field {
+	RIL_SNAPSHOT_IMEI		= (1 << 0),
+	RIL_SNAPSHOT_IMSI		= (1 << 1),
+	RIL_SNAPSHOT_BASEBAND		= (1 << 2),
+	RIL_SNAPSHOT_SMSC		= (1 << 3),
+	RIL_SNAPSHOT_OPERATOR		= (1 << 4),
+	RIL_SNAPSHOT_REGISTRATION	= (1 << 5),
+};
+
+typedef struct ril_snapshot {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t length;
+	char imei[33];
+	char imsi[33];
+	char sw_version[33];
+	char smsc_number[60];
+	char proper_plmn[9];
+	char SPN[NET_MAX_SPN_LEN];
+	char name[NET_MAX_NAME_LEN];
+	int32_t reg_state;
+	int32_t act;
+} ril_snapshot;
+
 void ril_state_lpm(void);
 
 /**
@@ -207,6 +255,109 @@ typedef struct ril_call_context {
 	RIL_Token token;
 } ril_call_context;
 
+enum ril_gprs_uplink_class {
+	GPRS_UPLINK_PRIO,	/* pure TCP ACKs, DNS, small packets */
+	GPRS_UPLINK_BULK,
+	GPRS_UPLINK_CLASS_COUNT,
+};
+
+#define GPRS_UPLINK_INTERACTIVE	(1 << 0)
+
+struct ril_gprs_uplink_packet {
+	struct list_head list;
+	uint64_t enqueued;	/* us, monotonic */
+	uint32_t length;
+	uint32_t flags;
+	uint8_t frame[0];	/* PROTO_DATA_HEADROOM, then the IP packet */
+};
+
+struct ril_gprs_uplink {
+	struct list_head queue[GPRS_UPLINK_CLASS_COUNT];
+	uint32_t queued;
+	uint32_t queued_bytes;
+	uint32_t queued_bytes_peak;
+	uint32_t limit;		/* bytes handed to the modem per round */
+	uint64_t next_xmit;	/* us, monotonic */
+	uint64_t hold_start;	/* us, first packet queued into an empty queue */
+	uint32_t interactive;	/* queued packets that must not be held */
+	uint32_t packets[GPRS_UPLINK_CLASS_COUNT];
+	uint64_t bytes[GPRS_UPLINK_CLASS_COUNT];
+	uint64_t sojourn_total;	/* us */
+	uint32_t sojourn_max;	/* us */
+	uint32_t throttled;	/* rounds cut short by the limit */
+};
+
+enum ril_gprs_direction {
+	GPRS_STATS_UPLINK,
+	GPRS_STATS_DOWNLINK,
+	GPRS_STATS_DIRECTION_COUNT,
+};
+
+/* log2 buckets from 128 us up, see gprs_stats_latency_bucket */
+#define GPRS_STATS_LATENCY_BUCKETS	SRS_GPRS_LATENCY_BUCKETS
+
+/*
+ * Per connection counters; each direction is only written by its own thread,
+ * readers under RIL_LOCK may see slightly stale values
+ */
+struct ril_gprs_stats {
+	uint32_t packets[GPRS_STATS_DIRECTION_COUNT];
+	uint64_t bytes[GPRS_STATS_DIRECTION_COUNT];
+	uint32_t dropped[GPRS_STATS_DIRECTION_COUNT];
+	uint32_t errors[GPRS_STATS_DIRECTION_COUNT];
+	uint32_t rate[GPRS_STATS_DIRECTION_COUNT];	/* bytes/s, EWMA */
+	uint64_t window_start[GPRS_STATS_DIRECTION_COUNT];	/* us, monotonic */
+	uint64_t window_bytes[GPRS_STATS_DIRECTION_COUNT];
+	uint32_t latency[GPRS_STATS_LATENCY_BUCKETS];	/* tun read to ipc_send completion */
+};
+
+/* Escalating recovery steps, one per check that still sees the stall */
+enum ril_gprs_stall_step {
+	GPRS_STALL_NONE,
+	GPRS_STALL_PROBE,	/* start network again on the same context */
+	GPRS_STALL_RESTART,	/* stop and start the context */
+	GPRS_STALL_REPORT,	/* report the call inactive to the framework */
+};
+
+struct ril_gprs_stall {
+	uint32_t tx_packets;	/* counters at the last check */
+	uint32_t rx_packets;
+	uint32_t tx_errors;
+	int step;
+	int restarting;
+	int probing;	/* a probe START_NETWORK awaits its CNF */
+	uint32_t probe_contextId;
+	uint64_t probe_time;	/* us, probe sent */
+};
+
+struct ril_gprs_dormancy {
+	uint32_t packets;	/* both directions, at the last check */
+	uint64_t idle_since;	/* us, monotonic */
+	uint64_t released_at;
+	uint32_t backoff;	/* ms added to dormancyIdleMs */
+	int released;
+	uint32_t requests;
+	uint32_t backoffs;	/* traffic came back right after a release */
+};
+
+#define GPRS_DOWNLINK_RING	64
+
+struct ril_gprs_downlink_frame {
+	uint8_t *frame;
+	uint8_t *payload;
+	uint32_t length;
+};
+
+/* Single producer (modem reader), single consumer (downlink writer) ring */
+struct ril_gprs_downlink {
+	pthread_t thread;
+	int event_fd;
+	int stop;
+	uint32_t head;
+	uint32_t tail;
+	struct ril_gprs_downlink_frame ring[GPRS_DOWNLINK_RING];
+};
+
 typedef struct ril_gprs_connection {
 	uint32_t contextId;
 	int status;
@@ -220,15 +371,28 @@ typedef struct ril_gprs_connection {
 
 	RIL_Token token;
 	RIL_DataCallFailCause fail_cause;
+	protoStartNetwork start_network;
+	uint64_t start_time;	/* us, start network sent */
+	int users;	/* data calls sharing this context */
 
 	pthread_t thread;
-	pthread_mutex_t mutex;
+	int event_fd;
 	int thread_state;
+
+	struct ril_gprs_uplink uplink;
+	struct ril_gprs_downlink downlink;
+	struct ril_gprs_stats stats;
+	struct ril_gprs_stall stall;
+	struct ril_gprs_dormancy dormancy;
+
+	struct list_head list;
 } ril_gprs_connection;
 
 typedef struct ril_net_select {
 	char * plmn;
 	tapiNetSearchCnf net_select_entry;
+
+	struct list_head list;
 } ril_net_select;
 
 typedef struct ril_request_sim_io_info {
@@ -241,6 +405,9 @@ typedef struct ril_request_sim_io_info {
 	int length;
 	int waiting;
 	RIL_Token token;
+
+	struct list_head list;
+	struct hash_node token_node;
 } ril_request_sim_io_info;
 
 struct ril_data {
@@ -249,11 +416,17 @@ struct ril_data {
 	struct ril_state state;
 	struct ril_tokens tokens;
 	ril_config config;
-	struct list_head *outgoing_sms;
-	struct list_head *gprs_connections;
-	struct list_head *net_select_list;
-	struct list_head *requests;
-	struct list_head *sim_io;
+	ril_snapshot snapshot;
+	int provisional;
+	struct list_head outgoing_sms;
+	struct list_head gprs_connections;
+	int tun_pool[MAX_CONNECTIONS];	/* persistent tun devices, by cid - 1 */
+	struct list_head net_select_list;
+	struct hash_map requests_token;
+	struct hash_map requests_id;
+	struct list_head sim_io;
+	struct hash_map sim_io_tokens;
+	struct ril_arena *arena;
 
 	char cached_sw_version[33];
 	uint8_t cached_bcd_imsi[14];
@@ -327,8 +500,15 @@ void ipc_proto_start_network_cnf(void* data);
 void ipc_proto_stop_network_cnf(void* data);
 void ipc_proto_stop_network_ind(void* data);
 void ipc_proto_receive_data_ind(void* data);
+int gprs_downlink_dispatch(struct modem_io *ipc_frame);
+void gprs_uplink_kick(void);
+void gprs_uplink_hold_update(void);
+void gprs_tun_pool_init(void);
+void gprs_stats_dump(struct ril_gprs_connection *gprs_connection);
+void srs_gprs_stats(struct srs_client_info *client, struct srs_message *message);
 void ipc_proto_suspend_network_ind(void* data);
 void ipc_proto_resume_network_ind(void* data);
+void ipc_proto_rrc_connection_ind(void* data);
 void ril_request_setup_data_call(RIL_Token t, void *data, int length);
 void ril_request_deactivate_data_call(RIL_Token t, void *data, int length);
 void ril_request_last_data_call_fail_cause(RIL_Token t);
@@ -357,6 +537,7 @@ void ril_request_data_registration_state(RIL_Token t);
 void ril_request_get_preferred_network_type(RIL_Token t);
 void ril_request_set_preferred_network_type(RIL_Token t, void *data, size_t datalen);
 void ril_request_query_available_networks(RIL_Token t);
+int ril_request_query_available_networks_cancel(RIL_Token t);
 void ril_request_query_network_selection_mode(RIL_Token t);
 void ril_request_set_network_selection_automatic(RIL_Token t);
 void ril_request_set_network_selection_manual(RIL_Token t, void *data, size_t datalen);
@@ -382,6 +563,7 @@ void ril_request_sim_io_unregister(struct ril_request_sim_io_info *sim_io);
 struct ril_request_sim_io_info *ril_request_sim_io_info_find(void);
 struct ril_request_sim_io_info *ril_request_sim_io_info_find_token(RIL_Token t);
 void ril_request_sim_io_info_clear(struct ril_request_sim_io_info *sim_io);
+int ril_request_sim_io_cancel(RIL_Token t);
 void ril_request_sim_io_next(void);
 void ril_request_sim_io_complete(RIL_Token t, int command, int fileid,
 	int p1, int p2, int p3, void *data, size_t size);
@@ -394,11 +576,14 @@ struct ril_request_send_sms_info {
 	unsigned char *smsc;
 	size_t smsc_size;
 	RIL_Token token;
+
+	struct list_head list;
 };
 void ipc_sms_send_status(void* data);
 int ril_request_send_sms_register(unsigned char *pdu, size_t pdu_size, unsigned char *smsc, size_t smsc_size, RIL_Token t);
 void ril_request_send_sms_unregister(struct ril_request_send_sms_info *send_sms);
 struct ril_request_send_sms_info *ril_request_send_sms_info_find(void);
+int ril_request_send_sms_cancel(RIL_Token t);
 void ril_request_send_sms_next(void);
 void ril_request_send_sms_complete(RIL_Token t, unsigned char *pdu, size_t pdu_size, unsigned char *smsc, size_t smsc_size);
 void ril_request_send_sms(RIL_Token t, void *data, size_t length);
@@ -0,0 +1,283 @@
+/**
+ * This file is part of mocha-ril.
+ *
+ * mocha-ril is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mocha-ril is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mocha-ril.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define LOG_TAG "RIL-Mocha-NETLINK"
+#include <utils/Log.h>
+
+#include "util.h"
+
+/*
+ * Interface configuration for the PDP tun devices: all the steps are sent
+ * to the kernel as one batch of rtnetlink requests, each one acked so that
+ * a failure can be pinned to the step that caused it.
+ */
+
+#define NETLINK_BUFFER_SIZE	1024
+#define NETLINK_STEPS_MAX	4
+
+struct netlink_batch {
+	uint8_t buffer[NETLINK_BUFFER_SIZE];
+	int length;
+	int count;
+	uint32_t seq;
+	const char *steps[NETLINK_STEPS_MAX];
+};
+
+static struct nlmsghdr *netlink_msg_add(struct netlink_batch *batch, const char *step,
+	uint16_t type, uint16_t flags, void *payload, int payload_len)
+{
+	struct nlmsghdr *nlh;
+	int length;
+
+	length = NLMSG_SPACE(payload_len);
+	if (batch->count >= NETLINK_STEPS_MAX || batch->length + length > NETLINK_BUFFER_SIZE)
+		return NULL;
+
+	nlh = (struct nlmsghdr *) (batch->buffer + batch->length);
+	memset(nlh, 0, length);
+	nlh->nlmsg_len = NLMSG_LENGTH(payload_len);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = batch->seq + batch->count;
+	memcpy(NLMSG_DATA(nlh), payload, payload_len);
+
+	batch->steps[batch->count] = step;
+	batch->count++;
+	batch->length += length;
+
+	return nlh;
+}
+
+static int netlink_attr_add(struct netlink_batch *batch, struct nlmsghdr *nlh,
+	uint16_t type, void *data, int data_len)
+{
+	struct rtattr *rta;
+	int length;
+
+	if (nlh == NULL)
+		return -1;
+
+	length = RTA_SPACE(data_len);
+	if (batch->length + length > NETLINK_BUFFER_SIZE)
+		return -1;
+
+	rta = (struct rtattr *) ((uint8_t *) nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(data_len);
+	memcpy(RTA_DATA(rta), data, data_len);
+
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + length;
+	batch->length = (uint8_t *) nlh - batch->buffer + NLMSG_ALIGN(nlh->nlmsg_len);
+
+	return 0;
+}
+
+/*
+ * Sends the whole batch and collects one ack per request. The kernel goes
+ * on with the following requests after a failed one, so every failure is
+ * reported. Returns 0 when all the steps succeeded, -1 otherwise.
+ */
+static int netlink_batch_send(struct netlink_batch *batch, const char *ifname)
+{
+	struct sockaddr_nl addr;
+	struct timeval timeout;
+	struct nlmsgerr *err;
+	struct nlmsghdr *nlh;
+	uint8_t reply[NETLINK_BUFFER_SIZE];
+	int acked = 0;
+	int failed = 0;
+	int step;
+	int fd;
+	int n;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+	if (fd < 0) {
+		ALOGE("%s: Couldn't open a netlink socket, errno: %d", __func__, errno);
+		return -1;
+	}
+
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (sendto(fd, batch->buffer, batch->length, 0, (struct sockaddr *) &addr, sizeof(addr)) != batch->length) {
+		ALOGE("%s: Couldn't send the netlink batch for %s, errno: %d", __func__, ifname, errno);
+		goto error;
+	}
+
+	while (acked < batch->count) {
+		n = recv(fd, reply, sizeof(reply), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("%s: No answer for %s after %d of %d steps, errno: %d", __func__, ifname, acked, batch->count, errno);
+			goto error;
+		}
+
+		for (nlh = (struct nlmsghdr *) reply; NLMSG_OK(nlh, (unsigned int) n); nlh = NLMSG_NEXT(nlh, n)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			step = nlh->nlmsg_seq - batch->seq;
+			if (step < 0 || step >= batch->count)
+				continue;
+
+			err = (struct nlmsgerr *) NLMSG_DATA(nlh);
+			/* Steps without NLM_F_REPLACE keep what is already there */
+			if (err->error == -EEXIST) {
+				ALOGD("%s: %s on %s already exists", __func__, batch->steps[step], ifname);
+			} else if (err->error != 0) {
+				ALOGE("%s: %s on %s failed: %s", __func__, batch->steps[step], ifname, strerror(-err->error));
+				failed++;
+			}
+			acked++;
+		}
+	}
+
+	close(fd);
+
+	return failed > 0 ? -1 : 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+static void netlink_batch_init(struct netlink_batch *batch)
+{
+	static uint32_t seq;
+
+	memset(batch, 0, sizeof(struct netlink_batch));
+	seq += NETLINK_STEPS_MAX;
+	batch->seq = seq;
+}
+
+/*
+ * Brings ifname up with the given MTU, address and a default route through
+ * it. Addresses are in network byte order, as in struct in_addr.
+ */
+int netlink_configure(const char *ifname, uint32_t address, int prefix_len, uint32_t gateway, int mtu)
+{
+	struct netlink_batch batch;
+	struct ifinfomsg ifi;
+	struct ifaddrmsg ifa;
+	struct rtmsg rtm;
+	struct nlmsghdr *nlh;
+	uint32_t value;
+	int index;
+
+	index = if_nametoindex(ifname);
+	if (index == 0) {
+		ALOGE("%s: Unable to find interface %s", __func__, ifname);
+		return -1;
+	}
+
+	netlink_batch_init(&batch);
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = index;
+	ifi.ifi_flags = IFF_UP;
+	ifi.ifi_change = IFF_UP;
+	nlh = netlink_msg_add(&batch, "link up", RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+	value = mtu;
+	if (netlink_attr_add(&batch, nlh, IFLA_MTU, &value, sizeof(value)) < 0)
+		goto error;
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = AF_INET;
+	ifa.ifa_prefixlen = prefix_len;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa.ifa_index = index;
+	nlh = netlink_msg_add(&batch, "address", RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof(ifa));
+	if (netlink_attr_add(&batch, nlh, IFA_LOCAL, &address, sizeof(address)) < 0 ||
+		netlink_attr_add(&batch, nlh, IFA_ADDRESS, &address, sizeof(address)) < 0)
+		goto error;
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = AF_INET;
+	rtm.rtm_table = RT_TABLE_MAIN;
+	rtm.rtm_protocol = RTPROT_BOOT;
+	rtm.rtm_type = RTN_UNICAST;
+	/* A gateway that is our own address just means the point to point peer */
+	rtm.rtm_scope = (gateway != 0 && gateway != address) ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+	/* Never replace a default route another interface (e.g. WiFi) installed */
+	nlh = netlink_msg_add(&batch, "default route", RTM_NEWROUTE, NLM_F_CREATE, &rtm, sizeof(rtm));
+	value = index;
+	if (netlink_attr_add(&batch, nlh, RTA_OIF, &value, sizeof(value)) < 0)
+		goto error;
+	if (rtm.rtm_scope == RT_SCOPE_UNIVERSE && netlink_attr_add(&batch, nlh, RTA_GATEWAY, &gateway, sizeof(gateway)) < 0)
+		goto error;
+
+	return netlink_batch_send(&batch, ifname);
+
+error:
+	ALOGE("%s: Netlink batch for %s doesn't fit", __func__, ifname);
+	return -1;
+}
+
+/*
+ * Reverse of netlink_configure: drops the address and takes the link down,
+ * which also takes the routes through it away
+ */
+int netlink_deconfigure(const char *ifname, uint32_t address, int prefix_len)
+{
+	struct netlink_batch batch;
+	struct ifinfomsg ifi;
+	struct ifaddrmsg ifa;
+	struct nlmsghdr *nlh;
+	int index;
+
+	index = if_nametoindex(ifname);
+	if (index == 0)
+		return -1;
+
+	netlink_batch_init(&batch);
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = AF_INET;
+	ifa.ifa_prefixlen = prefix_len;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa.ifa_index = index;
+	nlh = netlink_msg_add(&batch, "address removal", RTM_DELADDR, 0, &ifa, sizeof(ifa));
+	if (netlink_attr_add(&batch, nlh, IFA_LOCAL, &address, sizeof(address)) < 0)
+		return -1;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = index;
+	ifi.ifi_flags = 0;
+	ifi.ifi_change = IFF_UP;
+	if (netlink_msg_add(&batch, "link down", RTM_NEWLINK, 0, &ifi, sizeof(ifi)) == NULL)
+		return -1;
+
+	return netlink_batch_send(&batch, ifname);
+}
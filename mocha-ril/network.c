@@ -33,8 +33,6 @@
 int ril_net_select_register(char *plmn, tapiNetSearchCnf net_select_entry)
 {
 	struct ril_net_select *net_select;
-	struct list_head *list_end;
-	struct list_head *list;
 
 	net_select = calloc(1, sizeof(struct ril_net_select));
 	if (net_select == NULL)
@@ -45,14 +43,7 @@ int ril_net_select_register(char *plmn, tapiNetSearchCnf net_select_entry)
 
 	ALOGD("%s: added plmn %s", __func__, net_select->plmn);
 
-	list_end = ril_data.net_select_list;
-	while (list_end != NULL && list_end->next != NULL)
-		list_end = list_end->next;
-
-	list = list_head_alloc((void *) net_select, list_end, NULL);
-
-	if (ril_data.net_select_list == NULL)
-		ril_data.net_select_list = list;
+	list_add_tail(&net_select->list, &ril_data.net_select_list);
 
 	return 0;
 }
@@ -60,35 +51,22 @@ int ril_net_select_register(char *plmn, tapiNetSearchCnf net_select_entry)
 void ril_net_select_unregister(void)
 {
 	struct ril_net_select *net_select;
-	struct list_head *list;
+	struct ril_net_select *next;
 
-	list = ril_data.net_select_list;
-	while (list != NULL) {
-		net_select = (struct ril_net_select *)list->data;
+	list_for_each_entry_safe(net_select, next, &ril_data.net_select_list, list) {
+		list_del(&net_select->list);
 		free(net_select->plmn);
 		free(net_select);
-		ril_data.net_select_list = list->next;
-		list_head_free(list);
-		list = ril_data.net_select_list;
 	}
 }
 
 struct ril_net_select *ril_net_select_find_plmn(char *plmn)
 {
 	struct ril_net_select *net_select;
-	struct list_head *list;
 
-	list = ril_data.net_select_list;
-	while (list != NULL) {
-		net_select = (struct ril_net_select *) list->data;
-		if (net_select == NULL)
-			goto list_continue;
-
-		if (strcmp(net_select->plmn,plmn) == 0)
+	list_for_each_entry(net_select, &ril_data.net_select_list, list) {
+		if (strcmp(net_select->plmn, plmn) == 0)
 			return net_select;
-
-list_continue:
-		list = list->next;
 	}
 
 	return NULL;
@@ -247,6 +225,8 @@ void ipc_network_select(void* data)
 	strcpy(ril_data.state.SPN, netInfo->spn);
 	strcpy(ril_data.state.name, netInfo->name);
 
+	ril_snapshot_validate(RIL_SNAPSHOT_OPERATOR | RIL_SNAPSHOT_REGISTRATION);
+
 	if (ril_data.tokens.network_selection != 0)
 	{
 		if (netInfo->serviceLevel == TAPI_SERVICE_LEVEL_FULL)
@@ -297,6 +277,7 @@ void ipc_cell_info(void* data)
 			plmn_dec = mcc * 1000 + mnc;
 		}
 		sprintf(ril_data.state.proper_plmn, "%d", plmn_dec);
+		ril_snapshot_validate(0);
 	}
 	ril_request_unsolicited(RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED, NULL, 0);
 }
@@ -324,7 +305,6 @@ void ipc_network_nitz_info(void* data)
 void ipc_network_search_cnf(void* data)
 {
 	struct ril_net_select *net_select;
-	struct list_head *list;
 	char **response;
 	char *plmn;
 	int length, count, index;
@@ -335,7 +315,7 @@ void ipc_network_search_cnf(void* data)
 	ALOGD("%s: Packet with %d entries\n", __func__, num_entries);
 	count = 0;
 
-	if (ril_data.net_select_list != NULL)
+	if (!list_empty(&ril_data.net_select_list))
 	{
 		ALOGD("%s: List is not empty, cleaning...\n", __func__);
 		ril_net_select_unregister();
@@ -368,49 +348,47 @@ void ipc_network_search_cnf(void* data)
 	}
 	ALOGD("%s: List created with %d entries\n", __func__, count);
 
+	if (ril_data.tokens.query_avail_networks == RIL_TOKEN_NULL)
+	{
+		ALOGD("%s: No pending request (canceled?), only keeping the list", __func__);
+		return;
+	}
+
 	if (count == 0)
 	{
 		ril_request_complete(ril_data.tokens.query_avail_networks, RIL_E_SUCCESS, NULL, 0);
+		ril_data.tokens.query_avail_networks = RIL_TOKEN_NULL;
 		return;
 	}
 
 	length = sizeof(char *) * 4 * count;
-	response = (char **) calloc(1, length);
+	response = (char **) ril_arena_alloc(length);
+	if (response == NULL)
+	{
+		ril_request_complete(ril_data.tokens.query_avail_networks, RIL_E_GENERIC_FAILURE, NULL, 0);
+		ril_data.tokens.query_avail_networks = RIL_TOKEN_NULL;
+		return;
+	}
 	count = 0;
 
-	list = ril_data.net_select_list;
-
-	while (list != NULL) {
-		net_select = (struct ril_net_select *) list->data;
-
-		if (net_select == NULL)
-			goto list_continue;
-
+	list_for_each_entry(net_select, &ril_data.net_select_list, list) {
 		index = count * 4;
-		asprintf(&response[index], "%s", net_select->net_select_entry.name);
-		asprintf(&response[index + 1], "%s", net_select->net_select_entry.name);
-		asprintf(&response[index + 2], "%s", net_select->plmn);
+		response[index] = ril_arena_strdup(net_select->net_select_entry.name);
+		response[index + 1] = response[index];
+		response[index + 2] = net_select->plmn;
 		if (net_select->net_select_entry.bForbidden)
-			response[index + 3] = strdup("forbidden");
+			response[index + 3] = "forbidden";
 		else if (net_select->net_select_entry.bCurrent)
-			response[index + 3] = strdup("current");
+			response[index + 3] = "current";
 		else if (net_select->net_select_entry.bAvailable)
-			response[index + 3] = strdup("available");
+			response[index + 3] = "available";
 		else
-			response[index + 3] = strdup("unknown");
+			response[index + 3] = "unknown";
 		count++;
-
-list_continue:
-		list = list->next;
 	}
 
 	ril_request_complete(ril_data.tokens.query_avail_networks, RIL_E_SUCCESS, response, length);
-
-	for (i = 0; i < length / sizeof(char *); i++) {
-		if (response[i] != NULL)
-			free(response[i]);
-	}
-	free(response);
+	ril_data.tokens.query_avail_networks = RIL_TOKEN_NULL;
 }
 
 void ipc_network_select_cnf(void* data)
@@ -580,6 +558,20 @@ void ril_request_query_available_networks(RIL_Token t)
 	ril_data.tokens.query_avail_networks = t;
 }
 
+int ril_request_query_available_networks_cancel(RIL_Token t)
+{
+	if (t == RIL_TOKEN_NULL || ril_data.tokens.query_avail_networks != t)
+		return -1;
+
+	ALOGD("%s: Aborting network search", __func__);
+
+	/* Selection mode 0 is what automatic selection sets, keep a manual one */
+	tapi_network_search_abort(ril_data.config.bAutoAttach == TAPI_NETWORK_SELECTION_AUTO ? 0 : 1);
+	ril_data.tokens.query_avail_networks = RIL_TOKEN_NULL;
+
+	return 1;
+}
+
 void ril_request_query_network_selection_mode(RIL_Token t)
 {
 	int ril_mode;
@@ -49,6 +49,8 @@ void ipc_cp_system_start(void* data)
 	else
 		memcpy(ril_data.cached_sw_version, ipc_frame->data, desc_size);
 	ril_data.cached_sw_version[desc_size] = 0x00;
+	/* IMEI was handed to the modem before it sent IPC_SYSTEM */
+	ril_snapshot_validate(RIL_SNAPSHOT_IMEI | RIL_SNAPSHOT_BASEBAND);
 	suffix_size = ipc_frame->datasize - desc_size - 1;
 	if(suffix_size > 0) {
 		DEBUG_I("dumping rest of data from IPC_SYSTEM packet");
@@ -57,6 +57,9 @@ void ipc_sim_open(void *data)
 		ril_data.cached_bcd_imsi[i] = buf[i+0xB2 - size_delta];
 	/*Converting IMSI out of dat stuff to ASCII*/
 	imsi_bcd2ascii(ril_data.cached_imsi, ril_data.cached_bcd_imsi, imsi_len);
+	if (ril_data.snapshot.imsi[0] != 0 && strcmp(ril_data.snapshot.imsi, ril_data.cached_imsi) != 0)
+		ALOGD("%s: IMSI differs from the snapshot", __func__);
+	ril_snapshot_validate(RIL_SNAPSHOT_IMSI);
 	/* Clean print of IMSI*/
 	memset(buf + 0xB2 - size_delta, 0xFF, imsi_len);
 	ril_tokens_check();
@@ -76,7 +79,14 @@ void ipc_sim_status(void *data)
 	if (sim_state == SIM_STATE_PIN)
 		ril_data.state.bPinLock = 1;
 
-	if (sim_state == SIM_STATE_READY && ril_data.smsc_number[0] == 0)
+	/* Don't keep serving the IMSI and SMSC of a card that was removed */
+	if (sim_state == SIM_STATE_ABSENT && (ril_data.provisional & (RIL_SNAPSHOT_IMSI | RIL_SNAPSHOT_SMSC))) {
+		memset(ril_data.cached_imsi, 0, sizeof(ril_data.cached_imsi));
+		memset(ril_data.smsc_number, 0, sizeof(ril_data.smsc_number));
+		ril_snapshot_validate(RIL_SNAPSHOT_IMSI | RIL_SNAPSHOT_SMSC);
+	}
+
+	if (sim_state == SIM_STATE_READY && (ril_data.smsc_number[0] == 0 || (ril_data.provisional & RIL_SNAPSHOT_SMSC)))
 		//request SMSC number
 		sim_get_file_info(0x5, 0x6f42);
 
@@ -223,6 +233,10 @@ void ipc_sim_smsc_number(void* data)
 	buf = (uint8_t *)data + sizeof(simEventPacketHeader) + sizeof(simDataResponse);
 	dataLen = simResponse->bufLen;
 
+	/* The SMSC from the snapshot is replaced by what the SIM holds */
+	if (ril_data.provisional & RIL_SNAPSHOT_SMSC)
+		memset(ril_data.smsc_number, 0, sizeof(ril_data.smsc_number));
+
 	if  (ril_data.smsc_number[0] == 0)
 	{
 		for (i = dataLen - 15; i < dataLen + (int)buf[dataLen - 15] - 14; i++)
@@ -231,6 +245,7 @@ void ipc_sim_smsc_number(void* data)
 				strcat(ril_data.smsc_number, tmp);
 			}
 		ALOGD("%s : SMSC number: %s", __func__, ril_data.smsc_number);
+		ril_snapshot_validate(RIL_SNAPSHOT_SMSC);
 
 		if (ril_data.tokens.sim_io == RIL_TOKEN_DATA_WAITING)
 			ril_request_sim_io_next();
@@ -296,12 +311,12 @@ void ipc_sim_io_response(void* data)
 
 			sim_file_response.record_length = fileInfo->recordSize;
 
-			response.simResponse = data2string((void *) &sim_file_response, sizeof(sim_file_response));
+			response.simResponse = ril_arena_data2string((void *) &sim_file_response, sizeof(sim_file_response));
 			break;
 		case SIM_EVENT_READ_FILE:
 			buf = (uint8_t *)data + sizeof(simEventPacketHeader);
 			simDataResponse* simData = (simDataResponse*) buf;
-			response.simResponse = data2string(buf + sizeof(simDataResponse), simData->bufLen);
+			response.simResponse = ril_arena_data2string(buf + sizeof(simDataResponse), simData->bufLen);
 			break;
 		case SIM_EVENT_UPDATE_FILE:
 		case SIM_EVENT_SEARCH_RECORD:
@@ -327,14 +342,10 @@ void ipc_sim_io_response(void* data)
 			break;
 	}
 
-	ril_request_complete(ril_data.tokens.sim_io, RIL_E_SUCCESS, &response, sizeof(response));
-
 	if (response.simResponse != NULL)
-	{
 		ALOGD("%s: SIM File = %x, SIM response: %s", __func__, sim_io_info->fileid, response.simResponse);
-		free(response.simResponse);
-	}
 
+	ril_request_complete(ril_data.tokens.sim_io, RIL_E_SUCCESS, &response, sizeof(response));
 
 	ril_request_sim_io_unregister(sim_io_info);
 	// Send the next SIM I/O in the list
@@ -580,8 +591,6 @@ int ril_request_sim_io_register(RIL_Token t, int command, int fileid,
 	ALOGD("%s: fileid 0x%x", __func__, fileid);
 
 	struct ril_request_sim_io_info *sim_io;
-	struct list_head *list_end;
-	struct list_head *list;
 
 	sim_io = calloc(1, sizeof(struct ril_request_sim_io_info));
 	if (sim_io == NULL)
@@ -597,14 +606,8 @@ int ril_request_sim_io_register(RIL_Token t, int command, int fileid,
 	sim_io->waiting = 1;
 	sim_io->token = t;
 
-	list_end = ril_data.sim_io;
-	while (list_end != NULL && list_end->next != NULL)
-		list_end = list_end->next;
-
-	list = list_head_alloc((void *) sim_io, list_end, NULL);
-
-	if (ril_data.sim_io == NULL)
-		ril_data.sim_io = list;
+	list_add_tail(&sim_io->list, &ril_data.sim_io);
+	hash_map_add(&ril_data.sim_io_tokens, &sim_io->token_node, (uintptr_t) t);
 
 	if (sim_io_p != NULL)
 		*sim_io_p = sim_io;
@@ -613,66 +616,58 @@ int ril_request_sim_io_register(RIL_Token t, int command, int fileid,
 
 void ril_request_sim_io_unregister(struct ril_request_sim_io_info *sim_io)
 {
-	struct list_head *list;
-
 	if (sim_io == NULL)
 		return;
 
-	list = ril_data.sim_io;
-	while (list != NULL) {
-		if (list->data == (void *) sim_io) {
-			memset(sim_io, 0, sizeof(struct ril_request_sim_io_info));
-			free(sim_io);
-
-			if (list == ril_data.sim_io)
-				ril_data.sim_io = list->next;
+	list_del(&sim_io->list);
+	hash_map_del(&sim_io->token_node);
 
-			list_head_free(list);
-
-			break;
-		}
-list_continue:
-		list = list->next;
-	}
+	memset(sim_io, 0, sizeof(struct ril_request_sim_io_info));
+	free(sim_io);
 }
 
 struct ril_request_sim_io_info *ril_request_sim_io_info_find(void)
 {
-	struct ril_request_sim_io_info *sim_io;
-	struct list_head *list;
+	return list_first_entry(&ril_data.sim_io, struct ril_request_sim_io_info, list);
+}
+
+struct ril_request_sim_io_info *ril_request_sim_io_info_find_token(RIL_Token t)
+{
+	struct hash_node *node;
 
-	list = ril_data.sim_io;
-	while (list != NULL) {
-		sim_io = (struct ril_request_sim_io_info *) list->data;
-		if (sim_io == NULL)
-			goto list_continue;
+	node = hash_map_find(&ril_data.sim_io_tokens, (uintptr_t) t);
 
-		return sim_io;
-list_continue:
-		list = list->next;
-	}
-	return NULL;
+	return hash_map_entry(node, struct ril_request_sim_io_info, token_node);
 }
 
-struct ril_request_sim_io_info *ril_request_sim_io_info_find_token(RIL_Token t)
+int ril_request_sim_io_cancel(RIL_Token t)
 {
 	struct ril_request_sim_io_info *sim_io;
-	struct list_head *list;
-
-	list = ril_data.sim_io;
-	while (list != NULL) {
-		sim_io = (struct ril_request_sim_io_info *) list->data;
-		if (sim_io == NULL)
-			goto list_continue;
 
-		if (sim_io->token == t)
-			return sim_io;
+	sim_io = ril_request_sim_io_info_find_token(t);
+	if (sim_io == NULL)
+		return -1;
 
-list_continue:
-		list = list->next;
+	// Already sent to the modem, the response will be dropped
+	if (!sim_io->waiting) {
+		hash_map_del(&sim_io->token_node);
+		sim_io->token = RIL_TOKEN_CANCELED;
+		hash_map_add(&ril_data.sim_io_tokens, &sim_io->token_node, (uintptr_t) RIL_TOKEN_CANCELED);
+		ril_data.tokens.sim_io = RIL_TOKEN_CANCELED;
+		return 0;
 	}
 
-	return NULL;
+	ALOGD("%s: Dropping queued SIM I/O for fileid 0x%x", __func__, sim_io->fileid);
+
+	if (sim_io->data != NULL)
+		free(sim_io->data);
+
+	ril_request_sim_io_unregister(sim_io);
+
+	if (ril_data.tokens.sim_io == RIL_TOKEN_DATA_WAITING && ril_request_sim_io_info_find() == NULL)
+		ril_data.tokens.sim_io = RIL_TOKEN_NULL;
+
+	return 1;
 }
 
 void ril_request_sim_io_next(void)
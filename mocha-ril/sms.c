@@ -62,8 +62,6 @@ void ipc_sms_send_status(void* data)
 int ril_request_send_sms_register(unsigned char *pdu, size_t pdu_size, unsigned char *smsc, size_t smsc_size, RIL_Token t)
 {
 	struct ril_request_send_sms_info *send_sms;
-	struct list_head *list_end;
-	struct list_head *list;
 
 	send_sms = calloc(1, sizeof(struct ril_request_send_sms_info));
 	if (send_sms == NULL)
@@ -75,61 +73,54 @@ int ril_request_send_sms_register(unsigned char *pdu, size_t pdu_size, unsigned
 	send_sms->smsc_size = smsc_size;
 	send_sms->token = t;
 
-	list_end = ril_data.outgoing_sms;
-	while (list_end != NULL && list_end->next != NULL)
-		list_end = list_end->next;
-
-	list = list_head_alloc((void *) send_sms, list_end, NULL);
-
-	if (ril_data.outgoing_sms == NULL)
-		ril_data.outgoing_sms = list;
+	list_add_tail(&send_sms->list, &ril_data.outgoing_sms);
 
 	return 0;
 }
 
 void ril_request_send_sms_unregister(struct ril_request_send_sms_info *send_sms)
 {
-	struct list_head *list;
-
 	if (send_sms == NULL)
 		return;
 
-	list = ril_data.outgoing_sms;
-	while (list != NULL) {
-		if (list->data == (void *) send_sms) {
-			memset(send_sms, 0, sizeof(struct ril_request_send_sms_info));
-			free(send_sms);
-
-			if (list == ril_data.outgoing_sms)
-				ril_data.outgoing_sms = list->next;
+	list_del(&send_sms->list);
 
-			list_head_free(list);
-
-			break;
-		}
-list_continue:
-		list = list->next;
-	}
+	memset(send_sms, 0, sizeof(struct ril_request_send_sms_info));
+	free(send_sms);
 }
 
 struct ril_request_send_sms_info *ril_request_send_sms_info_find(void)
+{
+	return list_first_entry(&ril_data.outgoing_sms, struct ril_request_send_sms_info, list);
+}
+
+int ril_request_send_sms_cancel(RIL_Token t)
 {
 	struct ril_request_send_sms_info *send_sms;
-	struct list_head *list;
 
-	list = ril_data.outgoing_sms;
-	while (list != NULL) {
-		send_sms = (struct ril_request_send_sms_info *) list->data;
-		if (send_sms == NULL)
-			goto list_continue;
+	list_for_each_entry(send_sms, &ril_data.outgoing_sms, list) {
+		if (send_sms->token != t)
+			continue;
+
+		ALOGD("%s: Dropping queued outgoing SMS", __func__);
 
-		return send_sms;
+		if (send_sms->pdu != NULL && send_sms->pdu_size > 0)
+			free(send_sms->pdu);
+		if (send_sms->smsc != NULL && send_sms->smsc_size > 0)
+			free(send_sms->smsc);
+
+		ril_request_send_sms_unregister(send_sms);
+
+		return 1;
+	}
 
-list_continue:
-		list = list->next;
+	// Already sent to the modem, the status will be dropped
+	if (t == ril_data.tokens.outgoing_sms) {
+		ril_data.tokens.outgoing_sms = RIL_TOKEN_CANCELED;
+		return 0;
 	}
 
-	return NULL;
+	return -1;
 }
 
 void ril_request_send_sms_next(void)
@@ -35,11 +35,11 @@
 #include "mocha-ril.h"
 #include "util.h"
 
+#include <slab.h>
+
 int srs_client_register(struct srs_client_data *client_data, int fd)
 {
 	struct srs_client_info *client;
-	struct list_head *list_end;
-	struct list_head *list;
 
 	if (client_data == NULL)
 		return -1;
@@ -50,79 +50,36 @@ int srs_client_register(struct srs_client_data *client_data, int fd)
 
 	client->fd = fd;
 
-	list_end = client_data->clients;
-	while (list_end != NULL && list_end->next != NULL)
-		list_end = list_end->next;
-
-	list = list_head_alloc((void *) client, list_end, NULL);
-
-	if (client_data->clients == NULL)
-		client_data->clients = list;
+	list_add_tail(&client->list, &client_data->clients);
+	hash_map_add(&client_data->clients_fd, &client->fd_node, (uintptr_t) fd);
 
 	return 0;
 }
 
 void srs_client_unregister(struct srs_client_data *client_data, struct srs_client_info *client)
 {
-	struct list_head *list;
-
 	if (client_data == NULL || client == NULL)
 		return;
 
-	list = client_data->clients;
-	while (list != NULL) {
-		if (list->data == (void *) client) {
-			memset(client, 0, sizeof(struct srs_client_info));
-			free(client);
+	list_del(&client->list);
+	hash_map_del(&client->fd_node);
 
-			if (list == client_data->clients)
-				client_data->clients = list->next;
-
-			list_head_free(list);
-
-			break;
-		}
-list_continue:
-		list = list->next;
-	}
+	memset(client, 0, sizeof(struct srs_client_info));
+	free(client);
 }
 
 struct srs_client_info *srs_client_info_find(struct srs_client_data *client_data)
 {
-	struct srs_client_info *client;
-	struct list_head *list;
-
-	list = client_data->clients;
-	while (list != NULL) {
-		client = (struct srs_client_info *) list->data;
-		if (client == NULL)
-			goto list_continue;
-
-		return client;
-
-list_continue:
-		list = list->next;
-	}
-
-	return NULL;
+	return list_first_entry(&client_data->clients, struct srs_client_info, list);
 }
 
 struct srs_client_info *srs_client_info_find_type(struct srs_client_data *client_data, int type)
 {
 	struct srs_client_info *client;
-	struct list_head *list;
-
-	list = client_data->clients;
-	while (list != NULL) {
-		client = (struct srs_client_info *) list->data;
-		if (client == NULL)
-			goto list_continue;
 
+	list_for_each_entry(client, &client_data->clients, list) {
 		if (client->type == type)
 			return client;
-
-list_continue:
-		list = list->next;
 	}
 
 	return NULL;
@@ -130,47 +87,26 @@ list_continue:
 
 struct srs_client_info *srs_client_info_find_fd(struct srs_client_data *client_data, int fd)
 {
-	struct srs_client_info *client;
-	struct list_head *list;
-
-	list = client_data->clients;
-	while (list != NULL) {
-		client = (struct srs_client_info *) list->data;
-		if (client == NULL)
-			goto list_continue;
+	struct hash_node *node;
 
-		if (client->fd == fd)
-			return client;
-
-list_continue:
-		list = list->next;
-	}
+	node = hash_map_find(&client_data->clients_fd, (uintptr_t) fd);
 
-	return NULL;
+	return hash_map_entry(node, struct srs_client_info, fd_node);
 }
 
 int srs_client_info_fill_fd_set(struct srs_client_data *client_data, fd_set *fds)
 {
 	struct srs_client_info *client;
-	struct list_head *list;
 	int fd_max;
 
 	if (client_data == NULL || fds == NULL)
 		return -1;
 
 	fd_max = -1;
-	list = client_data->clients;
-	while (list != NULL) {
-		client = (struct srs_client_info *) list->data;
-		if (client == NULL)
-			goto list_continue;
-
+	list_for_each_entry(client, &client_data->clients, list) {
 		FD_SET(client->fd, fds);
 		if (client->fd > fd_max)
 			fd_max = client->fd;
-
-list_continue:
-		list = list->next;
 	}
 
 	return fd_max;
@@ -179,25 +115,15 @@ list_continue:
 int srs_client_info_get_fd_set(struct srs_client_data *client_data, fd_set *fds)
 {
 	struct srs_client_info *client;
-	struct list_head *list;
-	int fd;
 
 	if (client_data == NULL || fds == NULL)
 		return -1;
 
-	list = client_data->clients;
-	while (list != NULL) {
-		client = (struct srs_client_info *) list->data;
-		if (client == NULL)
-			goto list_continue;
-
+	list_for_each_entry(client, &client_data->clients, list) {
 		if (FD_ISSET(client->fd, fds)) {
 			FD_CLR(client->fd, fds);
 			return client->fd;
 		}
-
-list_continue:
-		list = list->next;
 	}
 
 	return -1;
@@ -220,7 +146,7 @@ int srs_client_send_message(struct srs_client_info *client, struct srs_message *
 	header.group = SRS_GROUP(message->command);
 	header.index = SRS_INDEX(message->command);
 
-	data = calloc(1, header.length);
+	data = ipc_slab_alloc(header.length);
 	if (data == NULL)
 		return -1;
 
@@ -249,11 +175,11 @@ int srs_client_send_message(struct srs_client_info *client, struct srs_message *
 		goto error;
 	}
 
-	free(data);
+	ipc_slab_free(data);
 	return rc;
 
 error:
-	free(data);
+	ipc_slab_free(data);
 	return 0;
 }
 
@@ -317,7 +243,7 @@ int srs_client_recv(struct srs_client_info *client, struct srs_message *message)
 	if (client == NULL || message == NULL)
 		return -1;
 
-	data = calloc(1, SRS_DATA_MAX_SIZE);
+	data = ipc_slab_alloc(SRS_DATA_MAX_SIZE);
 	if (data == NULL)
 		return -1;
 
@@ -345,21 +271,28 @@ int srs_client_recv(struct srs_client_info *client, struct srs_message *message)
 
 	header = (struct srs_header *) data;
 
+	if (header->length < sizeof(struct srs_header) || header->length > (unsigned int) rc) {
+		ALOGE("SRS message on fd %d claims %u bytes, only %d read", client->fd, header->length, rc);
+		goto error;
+	}
+
 	memset(message, 0, sizeof(struct srs_message));
 	message->command = SRS_COMMAND(header);
 	message->length = header->length - sizeof(struct srs_header);
 	if (message->length > 0) {
-		message->data = calloc(1, message->length);
+		message->data = ipc_slab_alloc(message->length);
+		if (message->data == NULL)
+			goto error;
 		memcpy(message->data, (void *) ((char *) data + sizeof(struct srs_header)), message->length);
 	} else {
 		message->data = NULL;
 	}
 
-	free(data);
+	ipc_slab_free(data);
 	return rc;
 
 error:
-	free(data);
+	ipc_slab_free(data);
 	return 0;
 }
 
@@ -456,7 +389,7 @@ void *srs_client_read_loop(void *data)
 			srs_dispatch(client, &message);
 
 			if (message.data != NULL)
-				free(message.data);
+				ipc_slab_free(message.data);
 		}
 		SRS_CLIENT_UNLOCK();
 	}
@@ -548,6 +481,7 @@ int srs_create(struct ril_client *client)
 	}
 
 	pthread_mutex_init(&client_data->mutex, NULL);
+	list_head_init(&client_data->clients);
 
 	client_data->client = client;
 	client->data = (void *) client_data;
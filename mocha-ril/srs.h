@@ -40,6 +40,9 @@
 struct srs_client_info {
 	int fd;
 	int type;
+
+	struct list_head list;
+	struct hash_node fd_node;
 };
 
 struct srs_client_data {
@@ -47,7 +50,8 @@ struct srs_client_data {
 
 	int server_fd;
 
-	struct list_head *clients;
+	struct list_head clients;
+	struct hash_map clients_fd;
 
 	pthread_t thread;
 	pthread_mutex_t mutex;
@@ -23,6 +23,7 @@
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -35,45 +36,199 @@
 #include "util.h"
 
 #include "mocha-ril.h"
+#include <fm.h>
 
 #define RIL_CONFIG_PATH "/data/radio/ril_config.bin"
+#define RIL_SNAPSHOT_PATH "/data/radio/ril_snapshot.bin"
+#define RIL_SNAPSHOT_TMP_PATH RIL_SNAPSHOT_PATH ".tmp"
+#define RIL_SNAPSHOT_SAVE_DELAY 2000 /* ms */
+#define RIL_SNAPSHOT_NETWORK_TIMEOUT 30000 /* ms */
 
 /**
  * List
  */
 
-struct list_head *list_head_alloc(void *data, struct list_head *prev, struct list_head *next)
+void list_head_init(struct list_head *head)
 {
-	struct list_head *list;
+	head->prev = head;
+	head->next = head;
+}
+
+void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+	entry->prev = head->prev;
+	entry->next = head;
+
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+void list_del(struct list_head *entry)
+{
+	if(entry->next == NULL || entry->prev == NULL)
+		return;
+
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+/**
+ * Hash map
+ */
+
+static unsigned int hash_map_bucket(uintptr_t key)
+{
+	// Tokens are pointers, fold in the bits above the alignment
+	key ^= key >> 4;
+	key ^= key >> 8;
+
+	return key % HASH_MAP_BUCKETS;
+}
+
+void hash_map_add(struct hash_map *map, struct hash_node *node, uintptr_t key)
+{
+	struct hash_node **bucket;
+
+	bucket = &map->buckets[hash_map_bucket(key)];
+
+	node->key = key;
+	node->next = *bucket;
+	node->pprev = bucket;
+
+	if(*bucket != NULL)
+		(*bucket)->pprev = &node->next;
+	*bucket = node;
+}
+
+void hash_map_del(struct hash_node *node)
+{
+	if(node->pprev == NULL)
+		return;
+
+	*node->pprev = node->next;
+	if(node->next != NULL)
+		node->next->pprev = node->pprev;
+
+	node->next = NULL;
+	node->pprev = NULL;
+}
+
+struct hash_node *hash_map_find(struct hash_map *map, uintptr_t key)
+{
+	struct hash_node *node;
+
+	for(node = map->buckets[hash_map_bucket(key)]; node != NULL; node = node->next) {
+		if(node->key == key)
+			return node;
+	}
+
+	return NULL;
+}
+
+/**
+ * Response arena
+ * Bump allocator for the response builders, everything it hands out is
+ * dropped at once by ril_arena_reset once the response went to RILD
+ */
+
+void *ril_arena_alloc(size_t size)
+{
+	struct ril_arena *arena;
+	size_t chunk_size;
+	void *p;
+
+	// Keep pointers in the arena aligned
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	arena = ril_data.arena;
+	if(arena == NULL || arena->size - arena->used < size) {
+		chunk_size = size > RIL_ARENA_CHUNK_SIZE ? size : RIL_ARENA_CHUNK_SIZE;
+
+		arena = malloc(sizeof(struct ril_arena) + chunk_size);
+		if(arena == NULL)
+			return NULL;
+
+		arena->next = ril_data.arena;
+		arena->size = chunk_size;
+		arena->used = 0;
 
-	list = calloc(1, sizeof(struct list_head));
-	if(list == NULL)
+		ril_data.arena = arena;
+	}
+
+	p = arena->data + arena->used;
+	arena->used += size;
+
+	memset(p, 0, size);
+
+	return p;
+}
+
+char *ril_arena_strdup(const char *string)
+{
+	char *p;
+	size_t length;
+
+	if(string == NULL)
+		return NULL;
+
+	length = strlen(string) + 1;
+
+	p = ril_arena_alloc(length);
+	if(p == NULL)
+		return NULL;
+
+	memcpy(p, string, length);
+
+	return p;
+}
+
+char *ril_arena_printf(const char *format, ...)
+{
+	va_list ap;
+	char *p;
+	int length;
+
+	va_start(ap, format);
+	length = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	if(length < 0)
 		return NULL;
 
-	list->data = data;
-	list->prev = prev;
-	list->next = next;
+	p = ril_arena_alloc(length + 1);
+	if(p == NULL)
+		return NULL;
 
-	if(prev != NULL)
-		prev->next = list;
-	if(next != NULL)
-		next->prev = list;
+	va_start(ap, format);
+	vsnprintf(p, length + 1, format, ap);
+	va_end(ap);
 
-	return list;
+	return p;
 }
 
-void list_head_free(struct list_head *list)
+void ril_arena_reset(void)
 {
-	if(list == NULL)
+	struct ril_arena *arena;
+
+	if(ril_data.arena == NULL)
 		return;
 
-	if(list->next != NULL)
-		list->next->prev = list->prev;
-	if(list->prev != NULL)
-		list->prev->next = list->next;
+	// Only keep the first chunk around, overflow chunks are rare
+	while(ril_data.arena->next != NULL) {
+		arena = ril_data.arena;
+		ril_data.arena = arena->next;
+		free(arena);
+	}
 
-	memset(list, 0, sizeof(struct list_head));
-	free(list);
+	ril_data.arena->used = 0;
 }
 
 /**
@@ -298,6 +453,14 @@ int tun_alloc(char *dev, int flags)
 void load_default_ril_config()
 {
 	ril_data.config.bAutoAttach = 1;
+	ril_data.config.uplinkHoldMs = 0;
+	ril_data.config.uplinkHoldBytes = 0x4000;
+	ril_data.config.stallCheckMs = 0;
+	ril_data.config.stallUplinkPackets = 10;
+	ril_data.config.stallErrors = 5;
+	ril_data.config.dormancyIdleMs = 0;
+	ril_data.config.fmDurability = FM_DURABILITY_COMMIT;
+	ril_data.config.fmCommitDeadlineMs = 200;
 }
 
 /* Return 0 in case of success, non-zero in case of failure */
@@ -310,8 +473,9 @@ int load_ril_config()
 		return fd;
 	}
 
+	/* Configs written before a field was added keep its default */
 	n = read(fd, &ril_data.config, sizeof(ril_config));
-	if(n != sizeof(ril_config))
+	if(n < (int) sizeof(uint32_t))
 		goto error;
 	ALOGD("%s: Read %d bytes from %s", __func__, n, RIL_CONFIG_PATH);
 	close(fd);
@@ -344,6 +508,220 @@ error:
 	return -1;
 }
 
+#define snapshot_strcpy(dst, src) \
+	strncpy(dst, src, sizeof(dst) - 1)
+
+static void ril_snapshot_fill(ril_snapshot *snapshot)
+{
+	memset(snapshot, 0, sizeof(ril_snapshot));
+
+	snapshot->magic = RIL_SNAPSHOT_MAGIC;
+	snapshot->version = RIL_SNAPSHOT_VERSION;
+	snapshot->length = sizeof(ril_snapshot);
+
+	snapshot_strcpy(snapshot->imei, cached_imei);
+	snapshot_strcpy(snapshot->imsi, ril_data.cached_imsi);
+	snapshot_strcpy(snapshot->sw_version, ril_data.cached_sw_version);
+	snapshot_strcpy(snapshot->smsc_number, ril_data.smsc_number);
+	snapshot_strcpy(snapshot->proper_plmn, ril_data.state.proper_plmn);
+	snapshot_strcpy(snapshot->SPN, ril_data.state.SPN);
+	snapshot_strcpy(snapshot->name, ril_data.state.name);
+	snapshot->reg_state = ril_data.state.reg_state;
+	snapshot->act = ril_data.state.act;
+}
+
+/*
+ * Registration can't be served from the snapshot for long: if the modem
+ * didn't report it by now (radio off, no coverage), the phone isn't registered
+ */
+static void ril_snapshot_network_expire(void *data)
+{
+	RIL_LOCK();
+
+	if(ril_data.provisional & (RIL_SNAPSHOT_OPERATOR | RIL_SNAPSHOT_REGISTRATION)) {
+		ALOGD("%s: Dropping provisional fields 0x%x", __func__,
+			ril_data.provisional & (RIL_SNAPSHOT_OPERATOR | RIL_SNAPSHOT_REGISTRATION));
+
+		if(ril_data.provisional & RIL_SNAPSHOT_OPERATOR) {
+			ril_data.state.proper_plmn[0] = 0;
+			ril_data.state.SPN[0] = 0;
+			ril_data.state.name[0] = 0;
+		}
+		if(ril_data.provisional & RIL_SNAPSHOT_REGISTRATION) {
+			ril_data.state.reg_state = 0;
+			ril_data.state.act = RADIO_TECH_UNKNOWN;
+		}
+		ril_data.provisional &= ~(RIL_SNAPSHOT_OPERATOR | RIL_SNAPSHOT_REGISTRATION);
+
+		ril_request_unsolicited(RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED, NULL, 0);
+	}
+
+	RIL_UNLOCK();
+}
+
+/*
+ * Loads the last known identity and registration values so that they can be
+ * served before the modem finished booting. Must run after ipc_init(), which
+ * clears the IMEI cache. Operator and registration only stay provisional for
+ * RIL_SNAPSHOT_NETWORK_TIMEOUT.
+ * Return 0 in case of success, non-zero in case of failure
+ */
+int load_ril_snapshot()
+{
+	ril_snapshot *snapshot = &ril_data.snapshot;
+	struct timeval tv;
+	int fd, n;
+
+	if( (fd = open(RIL_SNAPSHOT_PATH, O_RDONLY)) < 0 ) {
+		return fd;
+	}
+
+	n = read(fd, snapshot, sizeof(ril_snapshot));
+	close(fd);
+
+	if(n != sizeof(ril_snapshot) || snapshot->magic != RIL_SNAPSHOT_MAGIC ||
+		snapshot->version != RIL_SNAPSHOT_VERSION || snapshot->length != sizeof(ril_snapshot)) {
+		ALOGE("%s: Ignoring stale snapshot %s (%d bytes, version %d)", __func__, RIL_SNAPSHOT_PATH, n, n >= 8 ? (int) snapshot->version : -1);
+		memset(snapshot, 0, sizeof(ril_snapshot));
+		return -1;
+	}
+
+	snapshot->imei[sizeof(snapshot->imei) - 1] = 0;
+	snapshot->imsi[sizeof(snapshot->imsi) - 1] = 0;
+	snapshot->sw_version[sizeof(snapshot->sw_version) - 1] = 0;
+	snapshot->smsc_number[sizeof(snapshot->smsc_number) - 1] = 0;
+	snapshot->proper_plmn[sizeof(snapshot->proper_plmn) - 1] = 0;
+	snapshot->SPN[sizeof(snapshot->SPN) - 1] = 0;
+	snapshot->name[sizeof(snapshot->name) - 1] = 0;
+
+	if(snapshot->imei[0] != 0) {
+		strcpy(cached_imei, snapshot->imei);
+		ril_data.provisional |= RIL_SNAPSHOT_IMEI;
+	}
+	if(snapshot->imsi[0] != 0) {
+		strcpy(ril_data.cached_imsi, snapshot->imsi);
+		ril_data.provisional |= RIL_SNAPSHOT_IMSI;
+	}
+	if(snapshot->sw_version[0] != 0) {
+		strcpy(ril_data.cached_sw_version, snapshot->sw_version);
+		ril_data.provisional |= RIL_SNAPSHOT_BASEBAND;
+	}
+	if(snapshot->smsc_number[0] != 0) {
+		strcpy(ril_data.smsc_number, snapshot->smsc_number);
+		ril_data.provisional |= RIL_SNAPSHOT_SMSC;
+	}
+	if(snapshot->proper_plmn[0] != 0 || snapshot->name[0] != 0 || snapshot->SPN[0] != 0) {
+		strcpy(ril_data.state.proper_plmn, snapshot->proper_plmn);
+		strcpy(ril_data.state.SPN, snapshot->SPN);
+		strcpy(ril_data.state.name, snapshot->name);
+		ril_data.provisional |= RIL_SNAPSHOT_OPERATOR;
+	}
+	if(snapshot->reg_state != 0) {
+		ril_data.state.reg_state = snapshot->reg_state;
+		ril_data.state.act = snapshot->act;
+		ril_data.provisional |= RIL_SNAPSHOT_REGISTRATION;
+	}
+
+	if(ril_data.provisional & (RIL_SNAPSHOT_OPERATOR | RIL_SNAPSHOT_REGISTRATION)) {
+		tv.tv_sec = RIL_SNAPSHOT_NETWORK_TIMEOUT / 1000;
+		tv.tv_usec = (RIL_SNAPSHOT_NETWORK_TIMEOUT % 1000) * 1000;
+		ril_request_timed_callback(ril_snapshot_network_expire, NULL, &tv);
+	}
+
+	ALOGD("%s: Read %d bytes from %s, provisional fields: 0x%x", __func__, n, RIL_SNAPSHOT_PATH, ril_data.provisional);
+	return 0;
+}
+
+/*
+ * The snapshot is written to a temporary file first and renamed over the old
+ * one, so that a crash while saving never leaves a truncated snapshot behind.
+ * Takes RIL_LOCK only to copy the snapshot, the file is written without it.
+ * Return 0 in case of success, non-zero in case of failure
+ */
+int save_ril_snapshot()
+{
+	ril_snapshot snapshot;
+	int fd, n;
+
+	RIL_LOCK();
+	memcpy(&snapshot, &ril_data.snapshot, sizeof(ril_snapshot));
+	RIL_UNLOCK();
+
+	if( (fd = open(RIL_SNAPSHOT_TMP_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0660)) < 0 ) {
+		ALOGE("%s: Couldn't open %s for writing, errno: %d", __func__, RIL_SNAPSHOT_TMP_PATH, errno);
+		return fd;
+	}
+
+	n = write(fd, &snapshot, sizeof(ril_snapshot));
+	if(n != sizeof(ril_snapshot))
+		goto error;
+
+	fsync(fd);
+	close(fd);
+
+	if(rename(RIL_SNAPSHOT_TMP_PATH, RIL_SNAPSHOT_PATH) < 0) {
+		ALOGE("%s: Couldn't rename %s, errno: %d", __func__, RIL_SNAPSHOT_TMP_PATH, errno);
+		unlink(RIL_SNAPSHOT_TMP_PATH);
+		return -1;
+	}
+
+	ALOGD("%s: Written %d bytes to %s", __func__, n, RIL_SNAPSHOT_PATH);
+	return 0;
+error:
+	ALOGE("%s: Wrote only %d of %d bytes to %s", __func__, n, sizeof(ril_snapshot), RIL_SNAPSHOT_TMP_PATH);
+	close(fd);
+	unlink(RIL_SNAPSHOT_TMP_PATH);
+	return -1;
+}
+
+/*
+ * Registration changes come from the modem reader thread with RIL_LOCK held,
+ * so the snapshot is written from a timed callback a little later instead:
+ * a burst of changes then costs a single write.
+ */
+static int ril_snapshot_timer;
+
+static void ril_snapshot_save(void *data)
+{
+	RIL_LOCK();
+	ril_snapshot_timer = 0;
+	RIL_UNLOCK();
+
+	save_ril_snapshot();
+}
+
+/*
+ * Called once the modem reported the given fields again: they stop being
+ * provisional and the snapshot is rewritten if anything changed.
+ * Returns 1 if the snapshot was out of date, 0 otherwise.
+ */
+int ril_snapshot_validate(int fields)
+{
+	ril_snapshot snapshot;
+	struct timeval tv;
+
+	if(ril_data.provisional & fields)
+		ALOGD("%s: Modem confirmed provisional fields 0x%x", __func__, ril_data.provisional & fields);
+
+	ril_data.provisional &= ~fields;
+
+	ril_snapshot_fill(&snapshot);
+	if(memcmp(&snapshot, &ril_data.snapshot, sizeof(ril_snapshot)) == 0)
+		return 0;
+
+	memcpy(&ril_data.snapshot, &snapshot, sizeof(ril_snapshot));
+
+	if(!ril_snapshot_timer) {
+		tv.tv_sec = RIL_SNAPSHOT_SAVE_DELAY / 1000;
+		tv.tv_usec = (RIL_SNAPSHOT_SAVE_DELAY % 1000) * 1000;
+
+		ril_snapshot_timer = 1;
+		ril_request_timed_callback(ril_snapshot_save, NULL, &tv);
+	}
+
+	return 1;
+}
+
 size_t data2string_length(const void *data, size_t size)
 {
 	size_t length;
@@ -356,12 +734,23 @@ size_t data2string_length(const void *data, size_t size)
 	return length;
 }
 
+static void data2string_write(char *string, const void *data, size_t size)
+{
+	char *p;
+	size_t i;
+
+	p = string;
+
+	for (i = 0; i < size; i++) {
+		sprintf(p, "%02x", *((unsigned char *) data + i));
+		p += 2 * sizeof(char);
+	}
+}
+
 char *data2string(const void *data, size_t size)
 {
 	char *string;
 	size_t length;
-	char *p;
-	size_t i;
 
 	if (data == NULL || size == 0)
 		return NULL;
@@ -371,13 +760,31 @@ char *data2string(const void *data, size_t size)
 		return NULL;
 
 	string = (char *) calloc(1, length);
+	if (string == NULL)
+		return NULL;
 
-	p = string;
+	data2string_write(string, data, size);
 
-	for (i = 0; i < size; i++) {
-		sprintf(p, "%02x", *((unsigned char *) data + i));
-		p += 2 * sizeof(char);
-	}
+	return string;
+}
+
+char *ril_arena_data2string(const void *data, size_t size)
+{
+	char *string;
+	size_t length;
+
+	if (data == NULL || size == 0)
+		return NULL;
+
+	length = data2string_length(data, size);
+	if (length == 0)
+		return NULL;
+
+	string = (char *) ril_arena_alloc(length);
+	if (string == NULL)
+		return NULL;
+
+	data2string_write(string, data, size);
 
 	return string;
 }
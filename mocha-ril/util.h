@@ -22,14 +22,78 @@
 #ifndef _SAMSUNG_RIL_UTIL_H_
 #define _SAMSUNG_RIL_UTIL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+/*
+ * Intrusive list, the link lives in the owning struct
+ */
+
 struct list_head {
 	struct list_head *prev;
 	struct list_head *next;
-	void *data;
 };
 
-struct list_head *list_head_alloc(void *data, struct list_head *prev, struct list_head *next);
-void list_head_free(struct list_head *list);
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define list_first_entry(head, type, member) \
+	(list_empty(head) ? NULL : list_entry((head)->next, type, member))
+
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, __typeof__(*pos), member); \
+		&pos->member != (head); \
+		pos = list_entry(pos->member.next, __typeof__(*pos), member))
+
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_entry((head)->next, __typeof__(*pos), member), \
+		n = list_entry(pos->member.next, __typeof__(*pos), member); \
+		&pos->member != (head); \
+		pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+void list_head_init(struct list_head *head);
+void list_add_tail(struct list_head *entry, struct list_head *head);
+void list_del(struct list_head *entry);
+int list_empty(const struct list_head *head);
+
+/*
+ * Intrusive hash map, for id-, token- and fd-keyed lookups
+ */
+
+#define HASH_MAP_BUCKETS	16
+
+struct hash_node {
+	struct hash_node *next;
+	struct hash_node **pprev;
+	uintptr_t key;
+};
+
+struct hash_map {
+	struct hash_node *buckets[HASH_MAP_BUCKETS];
+};
+
+#define hash_map_entry(ptr, type, member) \
+	((ptr) == NULL ? NULL : container_of(ptr, type, member))
+
+void hash_map_add(struct hash_map *map, struct hash_node *node, uintptr_t key);
+void hash_map_del(struct hash_node *node);
+struct hash_node *hash_map_find(struct hash_map *map, uintptr_t key);
+
+struct ril_arena {
+	struct ril_arena *next;
+	size_t size;
+	size_t used;
+	unsigned char data[0];
+};
+
+#define RIL_ARENA_CHUNK_SIZE	0x1000
+
+void *ril_arena_alloc(size_t size);
+char *ril_arena_strdup(const char *string);
+char *ril_arena_printf(const char *format, ...);
+void ril_arena_reset(void);
 
 size_t gsm72ascii(unsigned char *gsm7, char **ascii, size_t size);
 size_t ascii2gsm7(char *ascii, unsigned char **gsm7, size_t size);
@@ -37,12 +101,18 @@ void hex_dump(void *data, int size);
 int utf8_write(char *utf8, int offset, int v);
 
 int tun_alloc(char *dev, int flags);
+int netlink_configure(const char *ifname, uint32_t address, int prefix_len, uint32_t gateway, int mtu);
+int netlink_deconfigure(const char *ifname, uint32_t address, int prefix_len);
 void load_default_ril_config(void);
 int load_ril_config(void);
 int save_ril_config(void);
+int load_ril_snapshot(void);
+int save_ril_snapshot(void);
+int ril_snapshot_validate(int fields);
 
 size_t data2string_length(const void *data, size_t size);
 char *data2string(const void *data, size_t size);
+char *ril_arena_data2string(const void *data, size_t size);
 size_t string2data_size(const char *string);
 void *string2data(const char *string);
 
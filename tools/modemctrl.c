@@ -41,6 +41,7 @@
 #include <tapi.h>
 #include <proto.h>
 #include <sim.h>
+#include <slab.h>
 
 #include <dlfcn.h>
 
@@ -88,7 +89,7 @@ int32_t modem_read_loop(struct ipc_client *client)
             ipc_dispatch(client, &resp);
 
             if(resp.data != NULL)
-                free(resp.data);
+                ipc_slab_free(resp.data);
         }
     }
 